@@ -0,0 +1,331 @@
+/**
+ * \file            bench.c
+ * \brief           Benchmark das funções da gpu_lib contra um dispositivo falso, sem precisar da FPGA
+ */
+
+/*
+ * Copyright (c) 2024 Pedro Henrique Araujo Almeida, Dermeval Neves de Oliveira Filho, Matheus
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE
+ * AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of library_name.
+ *
+ * Author:          Pedro Henrique ARAUJO ALMEIDA <phaalmeida1\gmail.com>
+ *                  Dermeval Neves de Oliveira Filho <dermevalneves\gmail.com>
+ *                  Matheus Mota Santos<matheuzwork\gmail.com>
+ */
+
+#define _GNU_SOURCE                                  /* F_SETPIPE_SZ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "gpu_lib.h"
+#include "gpu_image.h"
+
+/* Quantidade padrao de chamadas medidas por função */
+#define DEFAULT_CALLS 100000
+
+/* Tempo que o dispositivo lento leva para consumir um comando, proximo da GPU real */
+#define SLOW_COMMAND_NS 2000
+
+/* Tamanho do pipe do dispositivo lento, em bytes */
+#define SLOW_PIPE_SIZE 4096
+
+/**
+ * \brief           Dispositivo falso usado no lugar de /dev/gpu_driverN
+ */
+struct mock_device {
+    const char *name;                                /*!< Nome passado na linha de comando. */
+    char path[64];                                   /*!< Arquivo aberto pela gpu_lib. */
+    int reader_fd;                                   /*!< Lado de leitura do FIFO, -1 quando nao usado. */
+    uint32_t command_ns;                             /*!< Tempo gasto pelo leitor por comando recebido. */
+    pthread_t reader;
+};
+
+static uint64_t *samples;                            /* Duração de cada chamada da função medida */
+
+/**
+ * \brief           Usada para ler o relogio monotonico em nanossegundos
+ */
+static uint64_t now_ns() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+/**
+ * \brief           Leitor do FIFO, consome os comandos como o driver faria
+ */
+static void *mock_reader(void *arg) {
+    struct mock_device *mock = arg;
+    unsigned char buffer[4096];
+    ssize_t len;
+
+    while ((len = read(mock->reader_fd, buffer, sizeof(buffer))) > 0) {
+        if (mock->command_ns) {
+            struct timespec delay;
+            uint64_t ns = (uint64_t) (len / GPU_COMMAND_SIZE + 1) * mock->command_ns;
+
+            delay.tv_sec = ns / 1000000000u;
+            delay.tv_nsec = ns % 1000000000u;
+            nanosleep(&delay, NULL);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * \brief           Usada para criar o dispositivo falso escolhido
+ *
+ * null descarta os comandos em /dev/null, fifo os envia para uma thread que apenas le
+ * e slow le devagar de um pipe pequeno, entao a gpu_lib espera como com a GPU cheia.
+ * sim nao cria arquivo, a gpu_lib usa o seu simulador das filas da GPU, e mmio cria um
+ * arquivo comum que a gpu_lib mapeia no lugar dos registradores da ponte.
+ *
+ * \return          Retorna 1 quando o dispositivo foi criado, e 0 quando ocorreu uma falha
+ */
+static int mock_open(struct mock_device *mock, const char *name) {
+    memset(mock, 0, sizeof(*mock));
+    mock->name = name;
+    mock->reader_fd = -1;
+
+    if (strcmp(name, "null") == 0) {
+        strcpy(mock->path, "/dev/null");
+        return 1;
+    }
+    if (strcmp(name, "sim") == 0) {
+        strcpy(mock->path, "simulador");
+        return 1;
+    }
+    if (strcmp(name, "mmio") == 0) {
+        int regs;
+
+        /* Vazio, a gpu_lib aumenta o arquivo ate o tamanho da ponte com WRFULL zerado */
+        snprintf(mock->path, sizeof(mock->path), "/tmp/gpu_bench_%d.regs", (int) getpid());
+        regs = open(mock->path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (regs < 0) {
+            perror("Failed to create the register file");
+            return 0;
+        }
+        close(regs);
+        return 1;
+    }
+    if (strcmp(name, "fifo") != 0 && strcmp(name, "slow") != 0) {
+        fprintf(stderr, "Dispositivo desconhecido: %s\n", name);
+        return 0;
+    }
+
+    snprintf(mock->path, sizeof(mock->path), "/tmp/gpu_bench_%d", (int) getpid());
+    if (mkfifo(mock->path, 0600) < 0) {
+        perror("Failed to create the fifo");
+        return 0;
+    }
+    /* O_RDWR nao bloqueia esperando o outro lado do FIFO */
+    mock->reader_fd = open(mock->path, O_RDWR);
+    if (mock->reader_fd < 0) {
+        perror("Failed to open the fifo");
+        unlink(mock->path);
+        return 0;
+    }
+    if (strcmp(name, "slow") == 0) {
+        mock->command_ns = SLOW_COMMAND_NS;
+        fcntl(mock->reader_fd, F_SETPIPE_SZ, SLOW_PIPE_SIZE);
+    }
+    pthread_create(&mock->reader, NULL, mock_reader, mock);
+    return 1;
+}
+
+/**
+ * \brief           Usada para remover o dispositivo falso, depois que a gpu_lib fechou o arquivo
+ */
+static void mock_close(struct mock_device *mock) {
+    if (strcmp(mock->name, "mmio") == 0) {
+        unlink(mock->path);
+    }
+    if (mock->reader_fd < 0) {
+        return;
+    }
+    /* Sem escritores o read() do leitor so retorna quando o pipe esvaziar, entao cancela a thread */
+    pthread_cancel(mock->reader);
+    pthread_join(mock->reader, NULL);
+    close(mock->reader_fd);
+    unlink(mock->path);
+}
+
+static int compare_samples(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * \brief           Usada para mostrar o resultado de uma função medida
+ *
+ * \param[in]       name: Nome da função
+ * \param[in]       calls: Quantidade de chamadas em samples
+ * \param[in]       total_ns: Tempo total das chamadas
+ */
+static void report(const char *name, uint32_t calls, uint64_t total_ns) {
+    qsort(samples, calls, sizeof(*samples), compare_samples);
+    printf("%-28s %10u %14.0f %10.1f %10llu %10llu\n", name, calls, calls * 1e9 / total_ns, (double) total_ns / calls,
+           (unsigned long long) samples[calls / 2], (unsigned long long) samples[(uint64_t) calls * 99 / 100]);
+}
+
+/*
+ * Mede calls chamadas de CALL, que pode usar o indice i. Cada chamada é cronometrada
+ * sozinha para os percentis e o total conta o laço inteiro.
+ */
+#define BENCH(name, calls, CALL) do {                                                   \
+        uint32_t i;                                                                     \
+        uint64_t start = now_ns();                                                      \
+        for (i = 0; i < (calls); i++) {                                                 \
+            uint64_t call_start = now_ns();                                             \
+            CALL;                                                                       \
+            samples[i] = now_ns() - call_start;                                         \
+        }                                                                               \
+        report((name), (calls), now_ns() - start);                                      \
+    } while (0)
+
+int main(int argc, char *argv[]) {
+    struct mock_device mock;
+    struct gpu_sim_stats sim_stats;
+    Gpu_Device *gpu;
+    Sprite sp1 = { .pos_x = 100, .pos_y = 100 }, sp2 = { .pos_x = 110, .pos_y = 90 };
+    uint16_t bitmaps[2][GPU_SPRITE_PIXELS], blocks[GPU_BACKGROUND_BLOCKS];
+    struct gpu_image image = { .width = 640, .height = 480 };
+    int logical[64];
+    uint32_t calls = DEFAULT_CALLS, clears, pixel, failures = 0;
+    volatile int collided = 0;
+
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Uso: %s <null|fifo|slow|sim|mmio> [chamadas]\n", argv[0]);
+        return 1;
+    }
+    if (argc == 3) {
+        calls = strtoul(argv[2], NULL, 10);
+    }
+    if (calls == 0) {
+        fprintf(stderr, "Quantidade de chamadas inválida\n");
+        return 1;
+    }
+    /* Funções de limpeza enviam macros, sao medidas com menos chamadas */
+    clears = calls / 100 ? calls / 100 : 1;
+
+    samples = malloc(calls * sizeof(*samples));
+    image.rgb = malloc(image.width * image.height * 3);
+    if (samples == NULL || image.rgb == NULL || !mock_open(&mock, argv[1])) {
+        return 1;
+    }
+    if (strcmp(mock.name, "sim") == 0) {
+        gpu = open_gpu_simulator(NULL);
+    } else if (strcmp(mock.name, "mmio") == 0) {
+        gpu = open_gpu_device_with(&gpu_backend_mmio, mock.path);
+    } else {
+        gpu = open_gpu_device_at(mock.path);
+    }
+    if (gpu == NULL) {
+        mock_close(&mock);
+        return 1;
+    }
+    gpu_use_device(gpu);
+
+    printf("dispositivo %s (%s)\n", mock.name, mock.path);
+    printf("%-28s %10s %14s %10s %10s %10s\n", "funcao", "chamadas", "chamadas/s", "ns/chamada", "p50 ns", "p99 ns");
+
+    BENCH("set_sprite", calls, set_sprite(1 + i % 31, i % 640, i % 480, i % 32, 1));
+    BENCH("set_poligono", calls, set_poligono(i % 16, i % 512, i % 480, i % 16, 1, 2, 3, i & 1));
+    BENCH("set_background_block", calls, set_background_block(i % 80, i % 60, 1, 2, 3));
+    BENCH("set_background_color", calls, set_background_color(i & 7, 0, 0));
+    BENCH("set_sprite_pixel_color", calls, set_sprite_pixel_color(i % GPU_SPRITE_MEMORY_SIZE, 1, 2, 3));
+    /* Primeiro o bitmap inteiro, depois dois bitmaps que diferem em 8 pixels alternados no mesmo slot */
+    for (pixel = 0; pixel < GPU_SPRITE_PIXELS; pixel++) {
+        bitmaps[0][pixel] = bitmaps[1][pixel] = pixel % 20 < 10 ? GPU_COLOR(7, 0, 0) : GPU_COLOR_TRANSPARENT;
+    }
+    for (pixel = 0; pixel < 8; pixel++) {
+        bitmaps[1][pixel * 50] = GPU_COLOR(0, 7, 0);
+    }
+    BENCH("upload_sprite_bitmap", clears, upload_sprite_bitmap(i % GPU_SPRITE_SLOTS, bitmaps[0]));
+    BENCH("upload_sprite_bitmap (delta)", clears, upload_sprite_bitmap(0, bitmaps[i & 1]));
+    /* 64 bitmaps logicos em 8 slots, um registrador trocando de bitmap a cada chamada */
+    gpu_bitmap_reserve(0xFFu << 16);
+    for (pixel = 0; pixel < 64; pixel++) {
+        bitmaps[1][pixel] = GPU_COLOR(0, 0, 7);
+        logical[pixel] = gpu_bitmap_create(bitmaps[1]);
+    }
+    /*
+     * Os registradores ligados pelo caso set_sprite ocupariam todos os slots reservados. A
+     * troca de bitmap espera uma cerca, que so os transportes sem driver respondem aqui.
+     */
+    if (strcmp(mock.name, "sim") == 0 || strcmp(mock.name, "mmio") == 0) {
+        clear_sprites();
+        BENCH("set_sprite_bitmap (64 em 8)", clears, failures += !set_sprite_bitmap(1, 100, 100, logical[i % 64], 1));
+        if (failures) {
+            fprintf(stderr, "set_sprite_bitmap falhou %u vezes, medida inválida\n", failures);
+            close_gpu_device_at(gpu);
+            mock_close(&mock);
+            return 1;
+        }
+    }
+    /* Conversão de uma imagem de 640x480 em degradê, sem enviar nada para a GPU */
+    for (pixel = 0; pixel < image.width * image.height * 3; pixel++) {
+        image.rgb[pixel] = (pixel / 3 % image.width) * (pixel % 3 + 1) / 3 + pixel / 3 / image.width / 2;
+    }
+    BENCH("gpu_image_background", clears, gpu_image_background(&image, GPU_DITHER_NONE, blocks));
+    BENCH("gpu_image_background (bayer)", clears, gpu_image_background(&image, GPU_DITHER_ORDERED, blocks));
+    BENCH("gpu_image_background (floyd)", clears, gpu_image_background(&image, GPU_DITHER_FLOYD, blocks));
+    BENCH("gpu_image_sprite (bayer)", clears,
+          gpu_image_sprite(&image, i % 620, i % 460, GPU_DITHER_ORDERED, GPU_IMAGE_NO_KEY, bitmaps[0]));
+    BENCH("fill_background_rect", clears, fill_background_rect(0, 0, 80, 60, 1, 2, 3));
+    BENCH("fill_background_blocks", clears, fill_background_blocks(i % 60));
+    BENCH("clear_background_blocks", clears, clear_background_blocks());
+    BENCH("clear_poligonos", clears, clear_poligonos());
+    BENCH("clear_sprites", clears, clear_sprites());
+    BENCH("collision", calls, collided += collision(&sp1, &sp2));
+
+    /* O mesmo set_sprite acumulado em lotes de 32 comandos, como um quadro do jogo */
+    BENCH("set_sprite (lote de 32)", calls / 32 ? calls / 32 : 1, {
+        uint32_t reg;
+
+        gpu_begin_batch();
+        for (reg = 1; reg <= 32; reg++) {
+            set_sprite(reg % 32, i % 640, reg * 10, reg, 1);
+        }
+        gpu_submit_batch();
+    });
+
+    if (gpu_sim_get_stats(&sim_stats)) {
+        printf("simulador: %llu esperas por WRFULL, %.3f ms esperando, ocupação maxima %u\n",
+               (unsigned long long) sim_stats.stalls, sim_stats.stall_ns / 1e6, sim_stats.max_level);
+    }
+
+    close_gpu_device_at(gpu);
+    mock_close(&mock);
+    free(image.rgb);
+    free(samples);
+    return 0;
+}
@@ -39,27 +39,57 @@
 #include <linux/fs.h>
 #include <asm/uaccess.h>
 #include <linux/kernel.h>
+#include <linux/list.h>
 #include <linux/device.h>
 #include <linux/cdev.h>
+#include <linux/debugfs.h>
 #include <linux/delay.h>
+#include <linux/hrtimer.h>
+#include <linux/log2.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include "gpu_driver.h"
 
 /* Definição dos OPCODES das intruções */
-#define WBR 0b00
-#define WBM 0b10
-#define WSM 0b01
-#define DP  0b11
+#define WBR GPU_OPCODE_WBR
+#define WBM GPU_OPCODE_WBM
+#define WSM GPU_OPCODE_WSM
+#define DP  GPU_OPCODE_DP
 
 /* Endereço base de memorias */
-#define DATA_A  0x80
-#define DATA_B  0x70
-#define START 0xc0
-#define WRFULL 0xb0
-#define LW_BRIDGE_BASE 0xFF200000 
-#define LW_BRIDGE_SPAN 0x00005000 
+#define DATA_A  GPU_REG_DATA_A
+#define DATA_B  GPU_REG_DATA_B
+#define START GPU_REG_START
+#define WRFULL GPU_REG_WRFULL
+#define LW_BRIDGE_BASE GPU_BRIDGE_BASE
+#define LW_BRIDGE_SPAN GPU_BRIDGE_SPAN
+
+/* Quantidade de comandos de um lote copiados do usuario por vez */
+#define BATCH_CHUNK 32
+
+/* Quantidade de comandos de cada fila de prioridade do cliente (deve ser potencia de 2) */
+#define QUEUE_ENTRIES 4096
 
 #define DEVICE_NAME "gpu_driver"
+/* Quantidade maxima de GPUs (/dev/gpu_driver0..N) controladas pelo modulo */
+#define GPU_MAX_DEVICES 8
 #define CLASS_NAME "gpudriver_class"
 
+/* Tempo que close() espera o arbitro enviar os comandos pendentes antes de descarta-los */
+#define RELEASE_TIMEOUT_MS 2000
+
+/* Quantidade de faixas do histograma de latencia, a faixa i conta latencias de 2^i ate 2^(i+1) - 1 ns */
+#define LATENCY_BUCKETS 32
+
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Matheus Mota, Pedro Henrique e Dermeval Neves");
 MODULE_DESCRIPTION("Módulo de exemplo para envio de instruções");
@@ -67,79 +97,224 @@ MODULE_DESCRIPTION("Módulo de exemplo para envio de instruções");
 // Declaração de variáveis globais
 static int major_number;
 static struct class* gpu_class = NULL;
-static struct device* gpu_device = NULL;
+static struct dentry *debugfs_root;                  /* /sys/kernel/debug/gpu_driver, NULL sem debugfs */
+
+static unsigned long bases[GPU_MAX_DEVICES] = { LW_BRIDGE_BASE };
+static int nr_bases = 1;
+module_param_array(bases, ulong, &nr_bases, 0444);
+MODULE_PARM_DESC(bases, "Endereço fisico da ponte de cada GPU, a N-esima é controlada por /dev/gpu_driverN");
+
+static unsigned int fifo_poll_us = 50;
+module_param(fifo_poll_us, uint, 0644);
+MODULE_PARM_DESC(fifo_poll_us, "Intervalo em microssegundos entre leituras de WRFULL enquanto a fila da GPU estiver cheia");
+
+static unsigned int fifo_depth = 0;
+module_param(fifo_depth, uint, 0444);
+MODULE_PARM_DESC(fifo_depth, "Profundidade das filas DATA_A/DATA_B da GPU, 0 lê WRFULL antes de toda instrução");
+
+static unsigned int fifo_drain_ns = 10000;
+module_param(fifo_drain_ns, uint, 0644);
+MODULE_PARM_DESC(fifo_drain_ns, "Tempo maximo em nanossegundos que a GPU leva para consumir uma instrução da fila");
 
-volatile int *START_PTR;
-volatile int *WRFULL_PTR;
-volatile int *DATA_A_PTR;
-volatile int *DATA_B_PTR;
-void __iomem *LW_virtual;
+static unsigned int fifo_timeout_ms = 1000;
+module_param(fifo_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(fifo_timeout_ms, "Tempo maximo em milissegundos esperando WRFULL cair antes de considerar a GPU travada");
 
+static bool coalesce = true;
+module_param(coalesce, bool, 0644);
+MODULE_PARM_DESC(coalesce, "Descarta comandos pendentes sobrescritos por um comando posterior no mesmo alvo");
+
+static unsigned int lane_ratio = 8;
+module_param(lane_ratio, uint, 0644);
+MODULE_PARM_DESC(lane_ratio, "Comandos da fila de latencia enviados para cada instrução da fila de volume, 0 so envia volume com a de latencia vazia");
+
+struct gpu_client;
+
+/**
+ * \brief           Contadores de desempenho de uma GPU, exportados em /sys/kernel/debug/gpu_driver/gpuN
+ *
+ * Protegidos por gpu->lock, exceto bytes que é atualizado pelos produtores das filas.
+ */
+struct gpu_perf {
+    u64 instructions[4];                             /*!< Instruções enviadas, indexadas pelo OPCODE (WBR, WSM, WBM e DP). */
+    u64 stalls;                                      /*!< Vezes em que o envio esperou WRFULL cair. */
+    u64 stall_ns;                                    /*!< Tempo total esperando WRFULL cair. */
+    atomic64_t bytes;                                /*!< Bytes de comandos copiados do usuario (write() e anel). */
+    atomic64_t errors;                               /*!< Comandos ja aceitos que falharam ao serem enviados pelo arbitro. */
+    u64 latency[LATENCY_BUCKETS];                    /*!< Do inicio do write() (ou da leitura do anel) ate o START do ultimo comando do grupo. */
+};
+
+/**
+ * \brief           Estado de cada GPU controlada pelo driver, uma por /dev/gpu_driverN
+ *
+ * Cada GPU tem seus proprios registradores, fila da GPU e arbitro, entao as GPUs
+ * recebem comandos em paralelo.
+ */
+struct gpu_dev {
+    int index;                                       /*!< N de /dev/gpu_driverN. */
+    struct device *device;                           /*!< Dispositivo criado na classe do driver. */
+    void __iomem *LW_virtual;                        /*!< Ponte da GPU mapeada. */
+    volatile int *START_PTR;
+    volatile int *WRFULL_PTR;
+    volatile int *DATA_A_PTR;
+    volatile int *DATA_B_PTR;
+
+    struct mutex lock;                               /*!< Garante que a sequencia DATA_A/DATA_B/START de uma instrução nao seja intercalada. */
+    struct workqueue_struct *wq;                     /*!< Fila de trabalho que envia os comandos pendentes para a GPU. */
+    wait_queue_head_t fifo_wait;                     /*!< Processos esperando a fila da GPU ter espaço. */
+    wait_queue_head_t release_wait;                  /*!< Arquivos sendo fechados esperando o arbitro terminar de atende-los. */
+    struct hrtimer fifo_timer;                       /*!< Verifica WRFULL periodicamente enquanto a fila estiver cheia. */
+
+    /*
+     * Creditos da fila da GPU: quantidade minima de posições livres nas filas DATA_A/DATA_B.
+     * Enquanto houver creditos as instruções sao escritas sem ler WRFULL. A GPU consome pelo
+     * menos uma instrução a cada fifo_drain_ns, entao os creditos voltam com o tempo ate
+     * fifo_depth. Protegidos por lock.
+     */
+    unsigned int fifo_credits;
+    ktime_t fifo_credit_time;                        /*!< Momento ate o qual o consumo da GPU ja foi contado nos creditos. */
+
+    /*
+     * Agrupamento de escritas: antes de enviar os comandos pendentes de uma fila o arbitro
+     * anota, para cada alvo, a posição do ultimo comando da janela que escreve nele. Os
+     * comandos anteriores no mesmo alvo sao descartados. As tabelas so sao usadas pelo
+     * arbitro.
+     */
+    u32 *target_position;                            /*!< Posição do ultimo comando pendente de cada alvo. */
+    u32 *target_window;                              /*!< Janela em que target_position foi anotada. */
+    u32 window_id;
+
+    /*
+     * Arbitro: um unico trabalho envia os comandos de todos os arquivos abertos da GPU. Em
+     * cada fila de prioridade os arquivos sao atendidos em rodizio, um grupo por vez. Um
+     * grupo e tudo o que foi enviado em um write() ou publicado de uma vez no anel, e nunca
+     * e intercalado com comandos de outro arquivo na mesma fila.
+     */
+    struct list_head kick_list;                      /*!< Arquivos com comandos novos ainda nao vistos pelo arbitro. */
+    struct list_head lane_lists[GPU_LANES];          /*!< Arquivos esperando a vez em cada fila. */
+    struct gpu_client *lane_owner[GPU_LANES];        /*!< Arquivo no meio de um grupo em cada fila. */
+    struct gpu_client *accepting;                    /*!< Arquivo cujo anel esta sendo lido pelo arbitro. */
+    spinlock_t run_lock;                             /*!< Protege as listas, lane_owner e accepting. */
+    u32 latency_run;                                 /*!< Comandos de latencia enviados desde a ultima instrução de volume. */
+    struct work_struct arbiter_work;
+
+    struct gpu_perf perf;                            /*!< Contadores de desempenho, zerados pelo arquivo reset do debugfs. */
+    struct dentry *debugfs_dir;                      /*!< /sys/kernel/debug/gpu_driver/gpuN. */
+};
+
+static struct gpu_dev *gpus[GPU_MAX_DEVICES];
+static int gpu_count;
+
+/**
+ * \brief           Fila de prioridade com comandos esperando para serem enviados a GPU
+ */
+struct gpu_queue {
+    struct gpu_command *commands;                    /*!< Vetor com QUEUE_ENTRIES comandos. */
+    u32 *groups;                                     /*!< Grupo (publicação) de cada comando. */
+    ktime_t *stamps;                                 /*!< Momento em que cada comando chegou ao driver. */
+    u32 next;                                        /*!< Proxima posição escrita pelo produtor, ainda nao publicada. */
+    u32 head;                                        /*!< Fim dos comandos publicados para o arbitro. */
+    u32 tail;                                        /*!< Proxima posição enviada pelo arbitro. */
+    u32 window_end;                                  /*!< Fim da janela de agrupamento atual. */
+    u32 window;                                      /*!< Identificador da janela atual em target_window. */
+    u32 macro_index;                                 /*!< Proxima instrução da macro em tail. */
+};
+
+/**
+ * \brief           Estado de cada arquivo aberto do driver
+ */
+struct gpu_client {
+    struct gpu_dev *gpu;                             /*!< GPU aberta pelo arquivo. */
+    struct mutex lock;                               /*!< Serializa os produtores das filas (write() e o anel) e o mmap. */
+    struct gpu_queue lanes[GPU_LANES];               /*!< Filas de latencia e de volume. */
+    int lane;                                        /*!< Fila padrao do arquivo (GPU_LANE_*). */
+    u32 group;                                       /*!< Grupo dos comandos colocados e ainda nao publicados. */
+    struct gpu_ring *ring;                           /*!< Anel compartilhado com o usuario, NULL ate o mmap. */
+    u32 ring_tail;                                   /*!< Copia privada do tail, o usuario pode alterar a do anel. */
+    u32 ring_head;                                   /*!< Fim do grupo do anel sendo passado para as filas. */
+    struct list_head kick_node;                      /*!< Posição em kick_list. */
+    struct list_head lane_nodes[GPU_LANES];          /*!< Posição na lista de espera de cada fila. */
+    wait_queue_head_t wait;                          /*!< Acordada sempre que comandos do cliente chegam na GPU. */
+    u64 commands;                                    /*!< Comandos consumidos, lido com GPU_IOC_STATS. */
+    u64 coalesced;                                   /*!< Comandos descartados pelo agrupamento de escritas. */
+    bool discard;                                    /*!< Arquivo fechado sem a GPU consumir tudo, o resto das filas é descartado. */
+};
 
 static int device_open(struct inode *inodep, struct file *filep);
 static int device_release(struct inode *inodep, struct file *filep);
 static ssize_t device_write(struct file *filep, const char *buffer, size_t len, loff_t *offset);
+static long device_ioctl(struct file *filep, unsigned int cmd, unsigned long arg);
+static int device_mmap(struct file *filep, struct vm_area_struct *vma);
+static __poll_t device_poll(struct file *filep, poll_table *wait);
+static int device_fsync(struct file *filep, loff_t start, loff_t end, int datasync);
 
 static struct file_operations fops = {
     .open = device_open,
     .release = device_release,
     .write = device_write,
+    .unlocked_ioctl = device_ioctl,
+    .mmap = device_mmap,
+    .poll = device_poll,
+    .fsync = device_fsync,
 };
 
 /**
  * \brief           Usada enviar a intrução para as duas filas (DATA_A e DATA_B) da GPU com base no endereço de memoria
  * 
+ * \param[in]       gpu: GPU que recebe a instrução
  * \param[in]       opcode: Valor para a cor azul.
  * \param[in]       G: Valor para a cor verde.
  * \param[in]       R: Valor para a cor vermelha.
 */
-void send_instruction(volatile int opcode_enderecamentos, volatile int dados) {
+void send_instruction(struct gpu_dev *gpu, volatile int opcode_enderecamentos, volatile int dados) {
 
-    iowrite32(0, START_PTR); /* Atualiza o sinal de start para 0 fazendo com as intruções não sejam enviada*/
-    iowrite32(opcode_enderecamentos, DATA_A_PTR); /* Envia o OPCODE e o endereçamento necessario da intrução para a fila DATA_A*/
-    iowrite32(dados, DATA_B_PTR); /* Envia os dados necessarios da intrução para a fila DATA_B*/
-    iowrite32(1, START_PTR); /* Atualiza o sinal de start para 1 fazendo que as intruções sejam envidas */
-    iowrite32(0, START_PTR); /* Atualiza o sinal de start para 0 fazendo com as intruções não sejam enviadas */
+    gpu->perf.instructions[opcode_enderecamentos & 0b11]++; /* Chamada sempre com gpu->lock */
+    iowrite32(0, gpu->START_PTR); /* Atualiza o sinal de start para 0 fazendo com as intruções não sejam enviada*/
+    iowrite32(opcode_enderecamentos, gpu->DATA_A_PTR); /* Envia o OPCODE e o endereçamento necessario da intrução para a fila DATA_A*/
+    iowrite32(dados, gpu->DATA_B_PTR); /* Envia os dados necessarios da intrução para a fila DATA_B*/
+    iowrite32(1, gpu->START_PTR); /* Atualiza o sinal de start para 1 fazendo que as intruções sejam envidas */
+    iowrite32(0, gpu->START_PTR); /* Atualiza o sinal de start para 0 fazendo com as intruções não sejam enviadas */
 }
 
 /**
  * \brief           Usada montas a intrução WBR que muda a cor do background.
  * 
+ * \param[in]       gpu: GPU que recebe a instrução
  * \param[in]       B: Valor para a cor azul.
  * \param[in]       G: Valor para a cor verde.
  * \param[in]       R: Valor para a cor vermelha.
 */
-void instrucao_wbr(int b, int g, int r) {
+void instrucao_wbr(struct gpu_dev *gpu, int b, int g, int r) {
     volatile int opcode = WBR; /* Define o OPCODE da instrução */
     volatile int dados = (b << 6) | (g << 3) | r; /* Monta a intrução que sera enviada para a DATA_B com base no valor das cores do RGB */
-    send_instruction(opcode, dados); /* Usa a função para enviar as intruções para as filas e executa elas */
+    send_instruction(gpu, opcode, dados); /* Usa a função para enviar as intruções para as filas e executa elas */
 }
 
-void instrucao_wbr_sprite(int reg, int offset, int x, int y, int sp) {
+void instrucao_wbr_sprite(struct gpu_dev *gpu, int reg, int offset, int x, int y, int sp) {
     volatile int opcode = WBR; /* Define o OPCODE da instrução */
     volatile int opcode_reg = (reg << 4) | opcode ; /* Monta a instrução que era enviada para a DATA_A com bae no valor do registrador escolhido */
     volatile int dados = offset | (y << 9) | (x << 19); /* Monta a intrução que sera enviada para a DATA_B com base no valor de offset, x e y */
     if (sp) {
         dados |= (1 << 29); /* Atualiza a instrução montada com o valor de enable (sp) do sprite */
     }
-    send_instruction(opcode_reg, dados); /* Usa a função para enviar as intruções para as filas e executa elas */
+    send_instruction(gpu, opcode_reg, dados); /* Usa a função para enviar as intruções para as filas e executa elas */
 }
 
-void instrucao_wbm(int address, int r, int g, int b) {
+void instrucao_wbm(struct gpu_dev *gpu, int address, int r, int g, int b) {
     volatile int opcode = WBM; /* Define o OPCODE da instrução */
     volatile int dados = (b << 6) | (g << 3) | r; /* Monta a intrução que sera enviada para a DATA_B com base na cor RGB do bloco */
     volatile int opcode_reg = (address << 4) | opcode; /* Monta a instrução que era enviada para a DATA_A com base no endereço recebido */
-    send_instruction(opcode_reg, dados); /* Usa a função para enviar as intruções para as filas e executa elas */
+    send_instruction(gpu, opcode_reg, dados); /* Usa a função para enviar as intruções para as filas e executa elas */
 }
 
-void instrucao_wsm(int address, int r, int g, int b) {
+void instrucao_wsm(struct gpu_dev *gpu, int address, int r, int g, int b) {
     volatile int opcode = WSM; /* Define o OPCODE da instrução */
     volatile int dados = (b << 6) | (g << 3) | r; /* Monta a intrução que sera enviada para a DATA_B com base na cor RGB do pixel do sprite*/
     volatile int opcode_reg = (address << 4) | opcode; /* Monta a instrução que era enviada para a DATA_A com bae no endereço recebio */
-    send_instruction(opcode_reg, dados); /* Usa a função para enviar as intruções para as filas e executa elas */
+    send_instruction(gpu, opcode_reg, dados); /* Usa a função para enviar as intruções para as filas e executa elas */
 }
 
-void instrucao_dp(int address, int ref_x, int ref_y, int size, int r, int g, int b, int shape) {
+void instrucao_dp(struct gpu_dev *gpu, int address, int ref_x, int ref_y, int size, int r, int g, int b, int shape) {
     volatile int opcode = DP; /* Define o OPCODE da instrução */
     volatile int opcode_reg = (address << 4) | opcode; /* Monta a instrução que era enviada para a DATA_A com base no endereço recebido */
     volatile int rgb = (b << 6) | (g << 3) | r; /* Monta uma parte da intrução onde tem os valores RGB */
@@ -147,76 +322,172 @@ void instrucao_dp(int address, int ref_x, int ref_y, int size, int r, int g, int
     if (shape) {
         dados |= (1 << 31); /* Atualiza a intrução monstada com o valor do tipo do poligono*/
     }
-    send_instruction(opcode_reg, dados); /* Usa a função para enviar as intruções para as filas e executa elas */
+    send_instruction(gpu, opcode_reg, dados); /* Usa a função para enviar as intruções para as filas e executa elas */
 }
 
-static int device_open(struct inode *inodep, struct file *filep) {
-    return 0;
+/**
+ * \brief           Chamada pelo timer enquanto a fila esta cheia, acorda quem espera assim que WRFULL cair
+ */
+static enum hrtimer_restart fifo_timer_callback(struct hrtimer *timer) {
+    struct gpu_dev *gpu = container_of(timer, struct gpu_dev, fifo_timer);
+
+    if (ioread32(gpu->WRFULL_PTR)) {
+        hrtimer_forward_now(timer, ns_to_ktime((u64) fifo_poll_us * NSEC_PER_USEC));
+        return HRTIMER_RESTART;
+    }
+
+    wake_up_interruptible(&gpu->fifo_wait);
+    return HRTIMER_NORESTART;
 }
 
-static int device_release(struct inode *inodep, struct file *filep) {
+/**
+ * \brief           Usada para verificar se a fila da GPU tem espaço, armando o timer caso nao tenha
+ * \return          Retorna 1 quando a fila tem espaço e 0 quando esta cheia
+ */
+static int fifo_has_space(struct gpu_dev *gpu) {
+    if (!ioread32(gpu->WRFULL_PTR)) {
+        return 1;
+    }
+
+    hrtimer_start(&gpu->fifo_timer, ns_to_ktime((u64) fifo_poll_us * NSEC_PER_USEC), HRTIMER_MODE_REL);
     return 0;
 }
 
-static ssize_t device_write(struct file *filep, const char *buffer, size_t len, loff_t *offset)  {
-    unsigned char command[9]; 
-   
+/**
+ * \brief           Usada para devolver os creditos das instruções que a GPU ja consumiu desde a ultima contagem
+ */
+static void refill_credits(struct gpu_dev *gpu) {
+    ktime_t now = ktime_get();
+    u64 elapsed = ktime_to_ns(ktime_sub(now, gpu->fifo_credit_time));
+    u64 drained = fifo_drain_ns ? div_u64(elapsed, fifo_drain_ns) : fifo_depth;
+
+    if (gpu->fifo_credits + drained >= fifo_depth) {
+        gpu->fifo_credits = fifo_depth;
+        gpu->fifo_credit_time = now;
+    } else {
+        /* Guarda a fração de tempo que ainda nao completou uma instrução */
+        gpu->fifo_credits += drained;
+        gpu->fifo_credit_time = ktime_add_ns(gpu->fifo_credit_time, drained * fifo_drain_ns);
+    }
+}
+
+/**
+ * \brief           Usada para esperar a fila de instruções da GPU ter espaço livre
+ *
+ * Com fifo_depth configurado, WRFULL so é lido quando os creditos acabam.
+ *
+ * \return          Retorna 0 quando a fila tem espaço, -ERESTARTSYS quando a espera foi interrompida
+ *                  ou -ETIMEDOUT quando WRFULL nao caiu em fifo_timeout_ms (GPU travada)
+ */
+static int wait_fifo(struct gpu_dev *gpu) {
+    ktime_t stall_start;
+    long ret;
+
+    if (fifo_depth) {
+        if (gpu->fifo_credits == 0) {
+            refill_credits(gpu);
+        }
+        if (gpu->fifo_credits > 0) {
+            gpu->fifo_credits--;
+            return 0;
+        }
+    }
+
     /* Lê o valor de fila cheia */
-    int buffer_gpu = ioread32(WRFULL_PTR);
-    
-    /* Loop para quando a fila esta cheia o driver dar uma pequena pausa para esperar a fila liberar*/
-    while (buffer_gpu){
-        buffer_gpu = ioread32(WRFULL_PTR);
-        if (buffer_gpu == 0){
-            msleep(130);
-        }
-    };
-    
-    /* Verifica se o commando recebido esta nos padrões aceitaveis pelo kernel */
-    if (len < 4 || len > 7) {
-        printk(KERN_ALERT "Comprimento de comando inválido\n");
-        return -EINVAL;
+    if (ioread32(gpu->WRFULL_PTR)) {
+        /* Dorme ate o timer perceber que a fila liberou */
+        stall_start = ktime_get();
+        ret = wait_event_interruptible_timeout(gpu->fifo_wait, fifo_has_space(gpu),
+                                               msecs_to_jiffies(READ_ONCE(fifo_timeout_ms)));
+        gpu->perf.stalls++;
+        gpu->perf.stall_ns += ktime_to_ns(ktime_sub(ktime_get(), stall_start));
+        if (ret < 0) {
+            return ret;
+        }
+        if (ret == 0) {
+            return -ETIMEDOUT;
+        }
     }
 
-    if (copy_from_user(&command, buffer, sizeof(command))) {
-        return -EFAULT;
+    /* A fila tem pelo menos a posição que sera usada agora, a contagem recomeça deste momento */
+    gpu->fifo_credit_time = ktime_get();
+    return 0;
+}
+
+/**
+ * \brief           Usada para enviar uma instrução ja montada esperando a fila da GPU ter espaço
+ *
+ * \param[in]       gpu: GPU que recebe a instrução
+ * \param[in]       instruction: Instrução com DATA_A e DATA_B
+ * \return          Retorna 0 quando a instrução foi enviada ou o erro de wait_fifo()
+ */
+static int execute_instruction(struct gpu_dev *gpu, struct gpu_instruction instruction) {
+    int ret;
+
+    mutex_lock(&gpu->lock);
+    ret = wait_fifo(gpu);
+    if (ret == 0) {
+        send_instruction(gpu, instruction.data_a, instruction.data_b);
+    }
+    mutex_unlock(&gpu->lock);
+    return ret;
+}
+
+/**
+ * \brief           Usada para montar e enviar a instrução correspondente a um comando recebido do usuario
+ *
+ * Macros sao enviadas uma instrução por vez pelo arbitro (ver lane_step()).
+ *
+ * \param[in]       gpu: GPU que recebe a instrução
+ * \param[in]       command: Comando no formato avulso, o primeiro byte indica o tipo
+ * \return          Retorna 0 quando o comando foi enviado, -EINVAL quando o comando é desconhecido
+ *                  ou o erro de wait_fifo()
+ */
+static int execute_command(struct gpu_dev *gpu, const unsigned char *command) {
+    int ret;
+
+    mutex_lock(&gpu->lock);
+    ret = wait_fifo(gpu);
+    if (ret < 0) {
+        mutex_unlock(&gpu->lock);
+        return ret;
     }
 
     /* Switch case que chama a função de montar instruções com bae no valor recebedido pelo kernel */
     switch (command[0]) {
-        case 0:  { /* Intrução WBR de mudar cor do background */
+        case GPU_CMD_BACKGROUND_COLOR:  { /* Intrução WBR de mudar cor do background */
             int r = command[1];
             int g = command[2];
             int b = command[3];
-            instrucao_wbr(r, g, b);
+            instrucao_wbr(gpu, r, g, b);
             break;
         }
-        case 1: { /* Intrução WBR para colocar sprites na tela */
+        case GPU_CMD_SPRITE: { /* Intrução WBR para colocar sprites na tela */
             int reg = command[1];
             int offset = ((command[2] << 1) & 0x1FE) | ((command[3] >> 7) & 0x01); // 9-bit offset
             int x = ((command[3] << 3) & 0x3F8) | ((command[4] >> 5) & 0x07);     // 10-bit x
             int y = ((command[4] << 5) & 0x3E0) | ((command[5] >> 3) & 0x1F);     // 10-bit y
             int sp = command[6];
-            instrucao_wbr_sprite(reg, offset, x, y, sp);
+            instrucao_wbr_sprite(gpu, reg, offset, x, y, sp);
             break;
         }
-        case 2: { /* Instrução WBM para desenhar background blocks na tela */
+        case GPU_CMD_BACKGROUND_BLOCK: { /* Instrução WBM para desenhar background blocks na tela */
             int address = ((command[1] << 5) | (command[2] >> 3)); // 12-bit address
             int r = command[2] & 0b111;
             int g = command[3];
             int b = command[4];
-            instrucao_wbm(address, r, g, b);
+            instrucao_wbm(gpu, address, r, g, b);
             break;
         }
-        case 3: { /* Instrução WSM para mudar a cor de um pixel do sprite */
+        case GPU_CMD_SPRITE_PIXEL: { /* Instrução WSM para mudar a cor de um pixel do sprite */
             int address = (command[1] << 6) | (command[2]); // 14-bit address
             int r = command[3];
             int g = command[4];
             int b = command[5];
-            instrucao_wsm(address, r, g, b);
+            instrucao_wsm(gpu, address, r, g, b);
             break;
         }
-        case 4: { /* Instrução DP para colocar um poligono na tela */
+        case GPU_CMD_POLYGON: { /* Instrução DP para colocar um poligono na tela */
             int address = command[1];
             int ref_x = ((command[2] << 1) | command[3] >> 7);
             int ref_y = (((command[3] & 0b1111111) << 2) | command[4] >> 6);
@@ -225,21 +496,1121 @@ static ssize_t device_write(struct file *filep, const char *buffer, size_t len,
             int g = (command[5] >> 2) & 0b111;
             int b =  command[6] >> 5;
             int shape =  command[6] & 0b1;
-            instrucao_dp(address, ref_x, ref_y, size, r, g, b, shape);
+            instrucao_dp(gpu, address, ref_x, ref_y, size, r, g, b, shape);
+            break;
+        }
+        case GPU_CMD_RAW: { /* Instrução ja montada pelo usuario, so precisa ser validada */
+            struct gpu_instruction instruction = gpu_unpack_raw((const struct gpu_command *) command);
+
+            if (!gpu_instruction_valid(instruction)) {
+                printk(KERN_ALERT "Instrução inválida\n");
+                ret = -EINVAL;
+                break;
+            }
+            send_instruction(gpu, instruction.data_a, instruction.data_b);
             break;
         }
         default: { /* Caso o commando seja invalido o kernel envia um alerta */
             printk(KERN_ALERT "Comando desconhecido\n");
+            ret = -EINVAL;
+            break;
+        }
+    }
+    mutex_unlock(&gpu->lock);
+
+    return ret;
+}
+
+
+/**
+ * \brief           Usada para saber quantos comandos ainda cabem em uma fila do cliente
+ */
+static u32 queue_space(struct gpu_queue *queue) {
+    return QUEUE_ENTRIES - (queue->next - smp_load_acquire(&queue->tail));
+}
+
+/**
+ * \brief           Usada para verificar se o tipo de um comando é conhecido pelo driver
+ */
+static int validate_command(const struct gpu_command *command) {
+    if (command->bytes[0] == GPU_CMD_RAW) {
+        if (!gpu_instruction_valid(gpu_unpack_raw(command))) {
+            printk(KERN_ALERT "Instrução inválida\n");
             return -EINVAL;
         }
+        return 0;
+    }
+
+    if (gpu_is_macro(command)) {
+        if (!gpu_macro_valid(command)) {
+            printk(KERN_ALERT "Macro inválida\n");
+            return -EINVAL;
+        }
+        return 0;
+    }
+
+    if (command->bytes[0] > GPU_CMD_POLYGON) {
+        printk(KERN_ALERT "Comando desconhecido\n");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/**
+ * \brief           Usada para escolher a fila de prioridade de um comando
+ *
+ * \param[in]       command: Comando ja validado
+ * \param[in]       lane: Fila pedida pelo usuario (GPU_LANE_*), GPU_LANE_AUTO escolhe pelo OPCODE
+ * \return          Retorna GPU_LANE_LATENCY ou GPU_LANE_BULK
+ */
+static int command_lane(const struct gpu_command *command, int lane) {
+    if (lane != GPU_LANE_AUTO) {
+        return lane;
+    }
+
+    switch (command->bytes[0]) {
+        case GPU_CMD_BACKGROUND_BLOCK:
+        case GPU_CMD_SPRITE_PIXEL:
+        case GPU_CMD_FILL_BLOCKS:
+            return GPU_LANE_BULK;
+        case GPU_CMD_RAW: {
+            u32 opcode = gpu_unpack_raw(command).data_a & 0b11;
+
+            return (opcode == WBM || opcode == WSM) ? GPU_LANE_BULK : GPU_LANE_LATENCY;
+        }
+        default:
+            return GPU_LANE_LATENCY;
+    }
+}
+
+/**
+ * \brief           Usada para colocar um comando no fim de uma fila de prioridade, sem publicar
+ *
+ * O arbitro so ve o comando depois de publish_commands(). Chamada com client->lock.
+ *
+ * \param[in]       client: Cliente dono da fila
+ * \param[in]       command: Comando ja validado
+ * \param[in]       lane: GPU_LANE_LATENCY ou GPU_LANE_BULK
+ * \param[in]       stamp: Momento em que o comando chegou ao driver
+ * \return          Retorna 1 quando o comando foi colocado e 0 quando a fila esta cheia
+ */
+static int push_command(struct gpu_client *client, const struct gpu_command *command, int lane, ktime_t stamp) {
+    struct gpu_queue *queue = &client->lanes[lane];
+
+    if (queue_space(queue) == 0) {
+        return 0;
+    }
+    queue->commands[queue->next & (QUEUE_ENTRIES - 1)] = *command;
+    queue->groups[queue->next & (QUEUE_ENTRIES - 1)] = client->group;
+    queue->stamps[queue->next & (QUEUE_ENTRIES - 1)] = stamp;
+    queue->next++;
+    return 1;
+}
+
+/**
+ * \brief           Usada para publicar para o arbitro os comandos colocados desde a ultima publicação
+ *
+ * Os comandos publicados juntos, nas duas filas, formam um grupo. Chamada com client->lock.
+ *
+ * \param[in]       client: Cliente dono das filas
+ */
+static void publish_commands(struct gpu_client *client) {
+    bool published = false;
+    int lane;
+
+    for (lane = 0; lane < GPU_LANES; lane++) {
+        struct gpu_queue *queue = &client->lanes[lane];
+
+        if (queue->next != queue->head) {
+            smp_store_release(&queue->head, queue->next);
+            published = true;
+        }
+    }
+    if (published) {
+        client->group++;
+    }
+}
+
+/**
+ * \brief           Usada para descobrir o alvo escrito por um comando de uma instrução
+ *
+ * \param[in]       command: Comando no formato dos lotes
+ * \return          Retorna o alvo (ver gpu_target) ou -1 se o comando nao puder ser agrupado
+ */
+static int command_target(const struct gpu_command *command) {
+    const u8 *bytes = command->bytes;
+    struct gpu_instruction instruction;
+
+    switch (bytes[0]) {
+        case GPU_CMD_BACKGROUND_COLOR:
+            return gpu_target(WBR, 0);
+        case GPU_CMD_SPRITE:
+            return gpu_target(WBR, bytes[1]);
+        case GPU_CMD_BACKGROUND_BLOCK:
+            return gpu_target(WBM, (bytes[1] << 5) | (bytes[2] >> 3));
+        case GPU_CMD_SPRITE_PIXEL:
+            return gpu_target(WSM, (bytes[1] << 6) | bytes[2]);
+        case GPU_CMD_POLYGON:
+            return gpu_target(DP, bytes[1]);
+        case GPU_CMD_RAW:
+            instruction = gpu_unpack_raw(command);
+            if (!gpu_instruction_valid(instruction)) {
+                return -1;
+            }
+            return gpu_target(instruction.data_a & 0b11, instruction.data_a >> 4);
+        default:
+            return -1;
+    }
+}
+
+/**
+ * \brief           Usada para anotar o ultimo comando de cada alvo entre os comandos pendentes de uma fila
+ *
+ * A janela termina no primeiro macro comando, que escreve em varios alvos e por isso
+ * nao pode ser reordenado com os comandos ao redor. Cada fila tem sua propria janela,
+ * um alvo anotado por outra fila depois faz o comando ser enviado normalmente.
+ *
+ * \param[in]       gpu: GPU dona das tabelas de alvos
+ * \param[in]       queue: Fila com os comandos, a janela nova é guardada nela
+ * \param[in]       head: Posição apos o ultimo comando pendente
+ */
+static void coalesce_window(struct gpu_dev *gpu, struct gpu_queue *queue, u32 head) {
+    u32 position;
+
+    queue->window = ++gpu->window_id;
+    queue->window_end = head;
+    if (!READ_ONCE(coalesce)) {
+        return;
+    }
+
+    for (position = queue->tail; position != head; position++) {
+        const struct gpu_command *command = &queue->commands[position & (QUEUE_ENTRIES - 1)];
+        int target;
+
+        if (gpu_is_macro(command)) {
+            queue->window_end = position + 1;
+            return;
+        }
+        target = command_target(command);
+        if (target >= 0) {
+            gpu->target_position[target] = position;
+            gpu->target_window[target] = queue->window;
+        }
+    }
+}
+
+/**
+ * \brief           Usada para saber se o comando em tail é sobrescrito por um posterior da mesma janela
+ *
+ * \param[in]       gpu: GPU dona das tabelas de alvos
+ * \param[in]       queue: Fila com o comando
+ * \return          Retorna 1 se o comando pode ser descartado
+ */
+static int command_superseded(struct gpu_dev *gpu, struct gpu_queue *queue) {
+    int target;
+
+    if (!READ_ONCE(coalesce)) {
+        return 0;
+    }
+    target = command_target(&queue->commands[queue->tail & (QUEUE_ENTRIES - 1)]);
+    return target >= 0 && gpu->target_window[target] == queue->window && gpu->target_position[target] != queue->tail;
+}
+
+/**
+ * \brief           Usada para enviar o proximo comando de uma fila de prioridade
+ *
+ * Macros sao enviadas uma instrução por chamada, entao uma macro longa na fila de
+ * volume nao impede a fila de latencia de ser atendida no meio dela.
+ *
+ * \param[in]       client: Cliente dono da fila
+ * \param[in]       queue: Fila de prioridade
+ * \return          Retorna 0 quando a fila esta vazia e 1 quando uma instrução foi enviada, descartada
+ *                  ou falhou (contada em errors no debugfs; o resto de uma macro que falhou é descartado)
+ */
+static int lane_step(struct gpu_client *client, struct gpu_queue *queue) {
+    struct gpu_dev *gpu = client->gpu;
+    u32 head = smp_load_acquire(&queue->head);
+    const struct gpu_command *command;
+    int ret = 0;
+
+    if (queue->tail == head) {
+        return 0;
+    }
+    if (queue->tail == queue->window_end) {
+        coalesce_window(gpu, queue, head);
+    }
+
+    command = &queue->commands[queue->tail & (QUEUE_ENTRIES - 1)];
+    if (READ_ONCE(client->discard)) {
+        /* Arquivo fechado com a GPU travada: so libera a posição */
+        queue->macro_index = 0;
+    } else if (gpu_is_macro(command)) {
+        ret = execute_instruction(gpu, gpu_macro_instruction(command, queue->macro_index));
+        if (ret == 0 && ++queue->macro_index < gpu_macro_length(command)) {
+            return 1;
+        }
+        queue->macro_index = 0;
+    } else if (command_superseded(gpu, queue)) {
+        client->coalesced++;
+    } else {
+        ret = execute_command(gpu, command->bytes);
+    }
+
+    /* O write() ja retornou, entao a falha so pode ser contada e mostrada no debugfs */
+    if (ret < 0) {
+        atomic64_inc(&gpu->perf.errors);
+        printk_ratelimited(KERN_ALERT "Falha %d ao enviar um comando para a GPU %d\n", ret, gpu->index);
+    }
+
+    client->commands++;
+    smp_store_release(&queue->tail, queue->tail + 1); /* Libera a posição para o próximo write() */
+    if (wq_has_sleeper(&client->wait)) {
+        wake_up_interruptible(&client->wait);
+    }
+    return 1;
+}
+
+/**
+ * \brief           Usada para saber se a fila parou entre dois grupos
+ *
+ * \param[in]       queue: Fila de prioridade, logo apos lane_step()
+ */
+static bool lane_at_boundary(struct gpu_queue *queue) {
+    u32 tail = queue->tail;
+
+    if (queue->macro_index != 0) {
+        return false;
+    }
+    return tail == smp_load_acquire(&queue->head) ||
+           queue->groups[tail & (QUEUE_ENTRIES - 1)] != queue->groups[(tail - 1) & (QUEUE_ENTRIES - 1)];
+}
+
+/**
+ * \brief           Usada para saber se o anel do cliente tem comandos que ainda nao foram para as filas
+ */
+static bool ring_pending(struct gpu_client *client) {
+    return client->ring && READ_ONCE(client->ring->head) != client->ring_tail;
+}
+
+/**
+ * \brief           Usada para passar os comandos do anel compartilhado para as filas de prioridade
+ *
+ * Cada avanço de head observado no anel vira um grupo. Para quando o anel esvazia ou
+ * quando a fila de um comando esta cheia, nesse caso o grupo e dividido. Chamada com client->lock.
+ *
+ * \param[in]       client: Cliente dono do anel
+ */
+static void drain_ring(struct gpu_client *client) {
+    struct gpu_ring *ring = client->ring;
+    int lane = READ_ONCE(client->lane);
+    u32 tail = client->ring_tail;
+    ktime_t stamp = ktime_get();
+
+    for (;;) {
+        if (client->ring_head == tail) {
+            u32 head = smp_load_acquire(&ring->head);
+
+            if (head == tail) {
+                /* Marca o anel como parado e confere de novo para nao perder um comando publicado ao mesmo tempo */
+                WRITE_ONCE(ring->idle, 1);
+                smp_mb();
+                if (READ_ONCE(ring->head) == tail) {
+                    break;
+                }
+                WRITE_ONCE(ring->idle, 0);
+                continue;
+            }
+
+            /* O usuario pode escrever qualquer coisa em head, descarta um anel corrompido */
+            if (head - tail > GPU_RING_ENTRIES) {
+                printk(KERN_ALERT "Anel de comandos corrompido\n");
+                tail = head;
+                smp_store_release(&ring->tail, tail);
+                WRITE_ONCE(client->ring_tail, tail);
+                client->ring_head = tail;
+                continue;
+            }
+            client->ring_head = head;
+        }
+
+        while (tail != client->ring_head) {
+            /* Copia antes de usar, o usuario pode alterar o anel a qualquer momento */
+            struct gpu_command command = ring->commands[tail & (GPU_RING_ENTRIES - 1)];
+
+            if (validate_command(&command) == 0 && !push_command(client, &command, command_lane(&command, lane), stamp)) {
+                publish_commands(client); /* Fila cheia, continua quando o arbitro terminar um grupo do cliente */
+                return;
+            }
+            /* Contado so depois de consumido, com a fila cheia o mesmo comando é lido de novo */
+            atomic64_add(sizeof(command), &client->gpu->perf.bytes);
+            tail++;
+            smp_store_release(&ring->tail, tail); /* Libera a posição para a gpu_lib */
+            WRITE_ONCE(client->ring_tail, tail);
+        }
+        publish_commands(client);
+    }
+}
+
+/**
+ * \brief           Usada para avisar o arbitro que um cliente publicou comandos
+ */
+static void kick_client(struct gpu_client *client) {
+    struct gpu_dev *gpu = client->gpu;
+
+    spin_lock(&gpu->run_lock);
+    if (list_empty(&client->kick_node)) {
+        list_add_tail(&client->kick_node, &gpu->kick_list);
+    }
+    spin_unlock(&gpu->run_lock);
+    queue_work(gpu->wq, &gpu->arbiter_work);
+}
+
+/**
+ * \brief           Usada para colocar o cliente no fim da lista das filas em que ele tem comandos
+ *
+ * Chamada com run_lock. O dono atual de uma fila volta para a lista quando terminar o grupo.
+ */
+static void enqueue_lanes(struct gpu_client *client) {
+    struct gpu_dev *gpu = client->gpu;
+    int lane;
+
+    for (lane = 0; lane < GPU_LANES; lane++) {
+        struct gpu_queue *queue = &client->lanes[lane];
+
+        if (gpu->lane_owner[lane] != client && list_empty(&client->lane_nodes[lane]) &&
+            smp_load_acquire(&queue->head) != queue->tail) {
+            list_add_tail(&client->lane_nodes[lane], &gpu->lane_lists[lane]);
+        }
+    }
+}
+
+/**
+ * \brief           Usada pelo arbitro para passar o anel dos clientes avisados para as filas
+ */
+static void accept_kicks(struct gpu_dev *gpu) {
+    spin_lock(&gpu->run_lock);
+    while (!list_empty(&gpu->kick_list)) {
+        struct gpu_client *client = list_first_entry(&gpu->kick_list, struct gpu_client, kick_node);
+
+        list_del_init(&client->kick_node);
+        gpu->accepting = client;
+        spin_unlock(&gpu->run_lock);
+
+        /* O write() pode estar esperando o arbitro liberar espaço, entao nao espera a trava.
+           O write() avisa o arbitro de novo quando terminar */
+        if (READ_ONCE(client->ring) && mutex_trylock(&client->lock)) {
+            drain_ring(client);
+            mutex_unlock(&client->lock);
+        }
+
+        spin_lock(&gpu->run_lock);
+        gpu->accepting = NULL;
+        enqueue_lanes(client);
+    }
+    spin_unlock(&gpu->run_lock);
+}
+
+/**
+ * \brief           Usada para escolher a fila atendida agora, respeitando lane_ratio
+ *
+ * Chamada com run_lock.
+ *
+ * \return          Retorna GPU_LANE_LATENCY, GPU_LANE_BULK ou -1 quando nenhum cliente tem comandos
+ */
+static int pick_lane(struct gpu_dev *gpu) {
+    bool latency = gpu->lane_owner[GPU_LANE_LATENCY] || !list_empty(&gpu->lane_lists[GPU_LANE_LATENCY]);
+    bool bulk = gpu->lane_owner[GPU_LANE_BULK] || !list_empty(&gpu->lane_lists[GPU_LANE_BULK]);
+    u32 ratio = READ_ONCE(lane_ratio);
+
+    if (latency && (ratio == 0 || gpu->latency_run < ratio)) {
+        return GPU_LANE_LATENCY;
+    }
+    if (bulk) {
+        return GPU_LANE_BULK;
+    }
+    return latency ? GPU_LANE_LATENCY : -1;
+}
+
+/**
+ * \brief           Usada para contar no histograma a latencia de um grupo que acabou de chegar na GPU
+ *
+ * \param[in]       gpu: GPU que recebeu o grupo
+ * \param[in]       stamp: Momento em que o ultimo comando do grupo chegou ao driver
+ */
+static void record_latency(struct gpu_dev *gpu, ktime_t stamp) {
+    s64 ns = ktime_to_ns(ktime_sub(ktime_get(), stamp));
+    int bucket = ns > 0 ? ilog2((u64) ns) : 0;
+
+    mutex_lock(&gpu->lock);
+    gpu->perf.latency[min(bucket, LATENCY_BUCKETS - 1)]++;
+    mutex_unlock(&gpu->lock);
+}
+
+/**
+ * \brief           Trabalho que envia os comandos de todos os clientes para a GPU
+ *
+ * Em cada fila os clientes sao atendidos em rodizio, um grupo por vez: o cliente que
+ * começou um grupo continua dono da fila ate terminar o grupo.
+ *
+ * \param[in]       work: arbiter_work da GPU
+ */
+static void arbiter(struct work_struct *work) {
+    struct gpu_dev *gpu = container_of(work, struct gpu_dev, arbiter_work);
+
+    for (;;) {
+        struct gpu_client *client;
+        int lane;
+
+        accept_kicks(gpu);
+
+        spin_lock(&gpu->run_lock);
+        lane = pick_lane(gpu);
+        if (lane < 0) {
+            spin_unlock(&gpu->run_lock);
+            break;
+        }
+        client = gpu->lane_owner[lane];
+        if (!client) {
+            client = list_first_entry(&gpu->lane_lists[lane], struct gpu_client, lane_nodes[lane]);
+            list_del_init(&client->lane_nodes[lane]);
+            gpu->lane_owner[lane] = client;
+        }
+        spin_unlock(&gpu->run_lock);
+
+        lane_step(client, &client->lanes[lane]);
+        gpu->latency_run = (lane == GPU_LANE_LATENCY) ? gpu->latency_run + 1 : 0;
+
+        if (lane_at_boundary(&client->lanes[lane])) {
+            struct gpu_queue *queue = &client->lanes[lane];
+
+            record_latency(gpu, queue->stamps[(queue->tail - 1) & (QUEUE_ENTRIES - 1)]);
+
+            /* Fim do grupo: outro cliente pode usar a fila, este volta para o fim da lista */
+            spin_lock(&gpu->run_lock);
+            gpu->lane_owner[lane] = NULL;
+            enqueue_lanes(client);
+            if (ring_pending(client) && list_empty(&client->kick_node)) {
+                list_add_tail(&client->kick_node, &gpu->kick_list);
+            }
+            spin_unlock(&gpu->run_lock);
+            wake_up(&gpu->release_wait);
+        }
+        cond_resched();
+    }
+}
+
+/**
+ * \brief           Usada para saber se o arbitro terminou de atender um cliente que esta sendo fechado
+ */
+static bool client_released(struct gpu_client *client) {
+    struct gpu_dev *gpu = client->gpu;
+    bool released;
+    int lane;
+
+    spin_lock(&gpu->run_lock);
+    released = gpu->accepting != client && list_empty(&client->kick_node) && !ring_pending(client);
+    for (lane = 0; lane < GPU_LANES; lane++) {
+        struct gpu_queue *queue = &client->lanes[lane];
+
+        released = released && gpu->lane_owner[lane] != client && list_empty(&client->lane_nodes[lane]) &&
+                   smp_load_acquire(&queue->head) == queue->tail;
+    }
+    spin_unlock(&gpu->run_lock);
+    return released;
+}
+
+/**
+ * \brief           Usada para registrar a posição atual das filas e do anel do cliente como uma cerca
+ */
+static void fence_snapshot(struct gpu_client *client, struct gpu_fence *fence) {
+    int lane;
+
+    for (lane = 0; lane < GPU_LANES; lane++) {
+        fence->lanes[lane] = READ_ONCE(client->lanes[lane].head);
+    }
+    fence->ring = client->ring ? READ_ONCE(client->ring->head) : client->ring_tail;
+}
+
+/**
+ * \brief           Usada para verificar se o anel ja foi consumido ate a posição de uma cerca
+ */
+static int fence_ring_passed(struct gpu_client *client, const struct gpu_fence *fence) {
+    u32 ring_pending = fence->ring - READ_ONCE(client->ring_tail);
+
+    return ring_pending == 0 || ring_pending > GPU_RING_ENTRIES;
+}
+
+/**
+ * \brief           Usada para verificar se os comandos das filas anteriores a uma cerca ja chegaram na GPU
+ * \return          Retorna 1 quando a cerca foi alcançada, cercas invalidas sao consideradas alcançadas
+ */
+static int fence_lanes_passed(struct gpu_client *client, const struct gpu_fence *fence) {
+    int lane;
+
+    for (lane = 0; lane < GPU_LANES; lane++) {
+        u32 pending = fence->lanes[lane] - smp_load_acquire(&client->lanes[lane].tail);
+
+        if (pending != 0 && pending <= QUEUE_ENTRIES) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * \brief           Usada para esperar uma cerca, acordando o arbitro caso ele esteja parado
+ *
+ * Os comandos do anel so recebem posição nas filas quando o arbitro os retira do
+ * anel, entao primeiro espera o anel passar da cerca e depois as filas como estiverem.
+ */
+static int fence_wait(struct gpu_client *client, const struct gpu_fence *fence) {
+    struct gpu_fence lanes_fence = *fence;
+    int ret;
+
+    kick_client(client);
+
+    if (!fence_ring_passed(client, fence)) {
+        ret = wait_event_interruptible(client->wait, fence_ring_passed(client, fence));
+        if (ret < 0) {
+            return ret;
+        }
+        fence_snapshot(client, &lanes_fence);
+    }
+
+    return wait_event_interruptible(client->wait, fence_lanes_passed(client, &lanes_fence));
+}
+
+static int device_open(struct inode *inodep, struct file *filep) {
+    unsigned int minor = iminor(inodep);
+    struct gpu_client *client;
+    int lane;
+
+    /* Cada numero menor do dispositivo corresponde a uma GPU */
+    if (minor >= gpu_count) {
+        return -ENODEV;
+    }
+
+    client = kzalloc(sizeof(*client), GFP_KERNEL);
+    if (!client) {
+        return -ENOMEM;
+    }
+
+    for (lane = 0; lane < GPU_LANES; lane++) {
+        client->lanes[lane].commands = vmalloc(QUEUE_ENTRIES * sizeof(struct gpu_command));
+        client->lanes[lane].groups = vmalloc(QUEUE_ENTRIES * sizeof(u32));
+        client->lanes[lane].stamps = vmalloc(QUEUE_ENTRIES * sizeof(ktime_t));
+        if (!client->lanes[lane].commands || !client->lanes[lane].groups || !client->lanes[lane].stamps) {
+            for (; lane >= 0; lane--) {
+                vfree(client->lanes[lane].commands);
+                vfree(client->lanes[lane].groups);
+                vfree(client->lanes[lane].stamps);
+            }
+            kfree(client);
+            return -ENOMEM;
+        }
+    }
+
+    client->gpu = gpus[minor];
+    client->lane = GPU_LANE_AUTO;
+    mutex_init(&client->lock);
+    init_waitqueue_head(&client->wait);
+    INIT_LIST_HEAD(&client->kick_node);
+    for (lane = 0; lane < GPU_LANES; lane++) {
+        INIT_LIST_HEAD(&client->lane_nodes[lane]);
+    }
+    filep->private_data = client;
+    return 0;
+}
+
+static int device_release(struct inode *inodep, struct file *filep) {
+    struct gpu_client *client = filep->private_data;
+    int lane;
+
+    /* Envia o que ainda estiver pendente antes de liberar as filas e o anel */
+    kick_client(client);
+    if (!wait_event_timeout(client->gpu->release_wait, client_released(client), msecs_to_jiffies(RELEASE_TIMEOUT_MS))) {
+        /*
+         * A GPU nao consumiu os comandos a tempo (WRFULL preso): o resto é descartado sem tocar
+         * na GPU. O arbitro ainda pode estar em wait_fifo(), que desiste depois de fifo_timeout_ms.
+         */
+        printk(KERN_ALERT "GPU %d nao respondeu, descartando os comandos pendentes do arquivo fechado\n",
+               client->gpu->index);
+        WRITE_ONCE(client->discard, true);
+        kick_client(client);
+        wait_event(client->gpu->release_wait, client_released(client));
+    }
+
+    vfree(client->ring);
+    for (lane = 0; lane < GPU_LANES; lane++) {
+        vfree(client->lanes[lane].commands);
+        vfree(client->lanes[lane].groups);
+        vfree(client->lanes[lane].stamps);
+    }
+    kfree(client);
+    return 0;
+}
+
+/**
+ * \brief           Usada para mapear o anel de comandos do cliente no espaço do usuario
+ */
+static int device_mmap(struct file *filep, struct vm_area_struct *vma) {
+    struct gpu_client *client = filep->private_data;
+    unsigned long size = PAGE_ALIGN(sizeof(struct gpu_ring));
+    struct gpu_ring *ring;
+    int ret;
+
+    if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > size) {
+        return -EINVAL;
+    }
+
+    mutex_lock(&client->lock);
+    if (client->ring) {
+        mutex_unlock(&client->lock);
+        return -EBUSY;
+    }
+
+    ring = vmalloc_user(size);
+    if (!ring) {
+        mutex_unlock(&client->lock);
+        return -ENOMEM;
+    }
+    ring->idle = 1;
+
+    ret = remap_vmalloc_range(vma, ring, 0);
+    if (ret < 0) {
+        vfree(ring);
+    } else {
+        WRITE_ONCE(client->ring, ring);
+    }
+    mutex_unlock(&client->lock);
+    return ret;
+}
+
+static long device_ioctl(struct file *filep, unsigned int cmd, unsigned long arg) {
+    struct gpu_client *client = filep->private_data;
+    struct gpu_fence fence;
+    struct gpu_stats stats;
+
+    switch (cmd) {
+        case GPU_IOC_DOORBELL: { /* O anel saiu de vazio para nao vazio */
+            if (!client->ring) {
+                return -EINVAL;
+            }
+            WRITE_ONCE(client->ring->idle, 0);
+            kick_client(client);
+            return 0;
+        }
+        case GPU_IOC_FENCE: { /* Cerca com todos os comandos enviados ate agora */
+            fence_snapshot(client, &fence);
+            if (copy_to_user((void __user *) arg, &fence, sizeof(fence))) {
+                return -EFAULT;
+            }
+            return 0;
+        }
+        case GPU_IOC_WAIT_FENCE: { /* Espera os comandos anteriores a cerca chegarem na GPU */
+            if (copy_from_user(&fence, (void __user *) arg, sizeof(fence))) {
+                return -EFAULT;
+            }
+            return fence_wait(client, &fence);
+        }
+        case GPU_IOC_STATS: { /* Contadores do arquivo, atualizados pelo arbitro */
+            stats.commands = READ_ONCE(client->commands);
+            stats.coalesced = READ_ONCE(client->coalesced);
+            if (copy_to_user((void __user *) arg, &stats, sizeof(stats))) {
+                return -EFAULT;
+            }
+            return 0;
+        }
+        case GPU_IOC_SET_LANE: { /* Fila usada pelos proximos comandos sem fila escolhida no lote */
+            if ((long) arg != GPU_LANE_AUTO && arg != GPU_LANE_LATENCY && arg != GPU_LANE_BULK) {
+                return -EINVAL;
+            }
+            WRITE_ONCE(client->lane, (int) (long) arg);
+            return 0;
+        }
+        default:
+            return -ENOTTY;
+    }
+}
+
+/**
+ * \brief           Usada pelo fsync() para esperar todos os comandos ja enviados chegarem na GPU
+ */
+static int device_fsync(struct file *filep, loff_t start, loff_t end, int datasync) {
+    struct gpu_client *client = filep->private_data;
+    struct gpu_fence fence;
+
+    fence_snapshot(client, &fence);
+    return fence_wait(client, &fence);
+}
+
+/**
+ * \brief           Usada pelo poll()/select()/epoll para saber se as filas do cliente tem espaço
+ */
+static __poll_t device_poll(struct file *filep, poll_table *wait) {
+    struct gpu_client *client = filep->private_data;
+    int lane;
+
+    poll_wait(filep, &client->wait, wait);
+
+    for (lane = 0; lane < GPU_LANES; lane++) {
+        if (queue_space(&client->lanes[lane]) == 0) {
+            return 0;
+        }
+    }
+    return EPOLLOUT | EPOLLWRNORM;
+}
+
+/**
+ * \brief           Usada para colocar comandos nas filas do cliente, esperando espaço quando necessario
+ *
+ * \param[in]       client: Cliente dono das filas
+ * \param[in]       commands: Comandos ja copiados do usuario e validados
+ * \param[in]       count: Quantidade de comandos
+ * \param[in]       lane: Fila pedida pelo usuario (GPU_LANE_*)
+ * \param[in]       nonblock: Quando verdadeiro retorna em vez de esperar a fila ter espaço
+ * \param[in]       stamp: Inicio do write()
+ * \return          Retorna a quantidade de comandos enfileirados, -EAGAIN ou -ERESTARTSYS
+ */
+static ssize_t queue_commands(struct gpu_client *client, const struct gpu_command *commands, size_t count, int lane, bool nonblock,
+                              ktime_t stamp) {
+    size_t done = 0;
+
+    while (done < count) {
+        int target = command_lane(&commands[done], lane);
+        int ret;
+
+        if (push_command(client, &commands[done], target, stamp)) {
+            done++;
+            continue;
+        }
+
+        /* Fila cheia: publica o que ja foi colocado, dividindo o grupo, e espera o arbitro liberar espaço */
+        publish_commands(client);
+        kick_client(client);
+        if (nonblock) {
+            return done ? done : -EAGAIN;
+        }
+        ret = wait_event_interruptible(client->wait, queue_space(&client->lanes[target]) > 0);
+        if (ret < 0) {
+            return done ? done : ret;
+        }
+    }
+
+    return done;
+}
+
+/**
+ * \brief           Usada para enfileirar um lote de comandos (cabeçalho seguido de N comandos de tamanho fixo)
+ *
+ * \param[in]       client: Cliente que recebeu o lote
+ * \param[in]       buffer: Ponteiro do usuario para o inicio do lote
+ * \param[in]       len: Tamanho total do lote em bytes
+ * \param[in]       nonblock: Quando verdadeiro nao espera a fila do cliente liberar
+ * \param[in]       stamp: Inicio do write()
+ * \return          Retorna len quando todos os comandos foram enfileirados, o tamanho do cabeçalho mais
+ *                  os comandos enfileirados quando a espera foi interrompida, ou um erro negativo. Um lote
+ *                  com comando invalido é recusado inteiro, sem enfileirar nada
+ */
+static ssize_t queue_batch(struct gpu_client *client, const char *buffer, size_t len, bool nonblock, ktime_t stamp) {
+    struct gpu_batch_header header;
+    struct gpu_command commands[BATCH_CHUNK];
+    size_t done = 0;
+    int lane;
+    ssize_t ret;
+
+    if (len < sizeof(header)) {
+        return -EINVAL;
+    }
+    if (copy_from_user(&header, buffer, sizeof(header))) {
+        return -EFAULT;
+    }
+
+    /* O tamanho recebido deve bater exatamente com a quantidade de comandos do cabeçalho */
+    if (header.flags > GPU_BATCH_BULK || len != sizeof(header) + (size_t) header.count * GPU_COMMAND_SIZE) {
+        printk(KERN_ALERT "Lote de comandos inválido\n");
+        return -EINVAL;
+    }
+
+    if (header.flags == GPU_BATCH_LATENCY) {
+        lane = GPU_LANE_LATENCY;
+    } else if (header.flags == GPU_BATCH_BULK) {
+        lane = GPU_LANE_BULK;
+    } else {
+        lane = READ_ONCE(client->lane);
+    }
+
+    buffer += sizeof(header);
+
+    /* Valida o lote inteiro antes de enfileirar, assim um comando invalido nao deixa parte do lote na GPU */
+    while (done < header.count) {
+        size_t chunk = min_t(size_t, header.count - done, BATCH_CHUNK);
+        size_t i;
+
+        if (copy_from_user(commands, buffer + done * GPU_COMMAND_SIZE, chunk * GPU_COMMAND_SIZE)) {
+            return -EFAULT;
+        }
+        for (i = 0; i < chunk; i++) {
+            if (validate_command(&commands[i]) < 0) {
+                return -EINVAL;
+            }
+        }
+        done += chunk;
+    }
+
+    /* Copia os comandos em pedaços para nao ocupar muito da pilha do kernel */
+    done = 0;
+    while (done < header.count) {
+        size_t chunk = min_t(size_t, header.count - done, BATCH_CHUNK);
+        size_t i;
+
+        if (copy_from_user(commands, buffer + done * GPU_COMMAND_SIZE, chunk * GPU_COMMAND_SIZE)) {
+            return done ? sizeof(header) + done * GPU_COMMAND_SIZE : -EFAULT;
+        }
+        /* O buffer pode ter mudado desde a validação */
+        for (i = 0; i < chunk; i++) {
+            if (validate_command(&commands[i]) < 0) {
+                return done ? sizeof(header) + done * GPU_COMMAND_SIZE : -EINVAL;
+            }
+        }
+        atomic64_add(chunk * GPU_COMMAND_SIZE, &client->gpu->perf.bytes);
+
+        ret = queue_commands(client, commands, chunk, lane, nonblock, stamp);
+        if (ret < 0 || (size_t) ret < chunk) {
+            /* Fila cheia ou sinal depois de enfileirar parte do lote: informa quanto foi consumido */
+            if (ret > 0 || done > 0) {
+                return sizeof(header) + (done + max_t(ssize_t, ret, 0)) * GPU_COMMAND_SIZE;
+            }
+            return ret;
+        }
+        done += chunk;
     }
 
     return len;
 }
 
+static ssize_t device_write(struct file *filep, const char *buffer, size_t len, loff_t *offset)  {
+    struct gpu_client *client = filep->private_data;
+    struct gpu_command command;
+    bool nonblock = filep->f_flags & O_NONBLOCK;
+    ktime_t stamp = ktime_get();
+    ssize_t ret;
+
+    if (len == 0) {
+        return 0;
+    }
+
+    if (copy_from_user(command.bytes, buffer, 1)) {
+        return -EFAULT;
+    }
+
+    mutex_lock(&client->lock);
+
+    /* Lote com varios comandos em uma unica chamada */
+    if (command.bytes[0] == GPU_CMD_BATCH) {
+        ret = queue_batch(client, buffer, len, nonblock, stamp);
+        goto out;
+    }
+   
+    /* Verifica se o commando recebido esta nos padrões aceitaveis pelo kernel */
+    if ((command.bytes[0] > GPU_CMD_POLYGON) ? len != GPU_COMMAND_SIZE : (len < 4 || len > 7)) {
+        printk(KERN_ALERT "Comprimento de comando inválido\n");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    memset(&command, 0, sizeof(command));
+    if (copy_from_user(command.bytes, buffer, len)) {
+        ret = -EFAULT;
+        goto out;
+    }
+    atomic64_add(len, &client->gpu->perf.bytes);
+
+    ret = validate_command(&command);
+    if (ret == 0) {
+        ret = queue_commands(client, &command, 1, READ_ONCE(client->lane), nonblock, stamp);
+        if (ret > 0) {
+            ret = len;
+        }
+    }
+
+out:
+    /* Os comandos deste write() formam um grupo, o arbitro nao intercala outro arquivo no meio dele */
+    publish_commands(client);
+    mutex_unlock(&client->lock);
+    /* O envio para a GPU acontece no arbitro, write() nao espera a fila da GPU */
+    kick_client(client);
+    return ret;
+}
+
+/**
+ * \brief           Usada pelo arquivo stats do debugfs para mostrar os contadores da GPU
+ */
+static int stats_show(struct seq_file *file, void *unused) {
+    struct gpu_dev *gpu = file->private;
+
+    mutex_lock(&gpu->lock);
+    seq_printf(file, "wbr %llu\n", gpu->perf.instructions[WBR]);
+    seq_printf(file, "wsm %llu\n", gpu->perf.instructions[WSM]);
+    seq_printf(file, "wbm %llu\n", gpu->perf.instructions[WBM]);
+    seq_printf(file, "dp %llu\n", gpu->perf.instructions[DP]);
+    seq_printf(file, "stalls %llu\n", gpu->perf.stalls);
+    seq_printf(file, "stall_ns %llu\n", gpu->perf.stall_ns);
+    mutex_unlock(&gpu->lock);
+    seq_printf(file, "bytes %lld\n", (long long) atomic64_read(&gpu->perf.bytes));
+    seq_printf(file, "errors %lld\n", (long long) atomic64_read(&gpu->perf.errors));
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats);
+
+/**
+ * \brief           Usada pelo arquivo latency do debugfs para mostrar o histograma, uma faixa nao vazia por linha
+ */
+static int latency_show(struct seq_file *file, void *unused) {
+    struct gpu_dev *gpu = file->private;
+    int bucket;
+
+    mutex_lock(&gpu->lock);
+    for (bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+        if (gpu->perf.latency[bucket]) {
+            seq_printf(file, "%llu-%llu ns %llu\n", 1ULL << bucket, (2ULL << bucket) - 1, gpu->perf.latency[bucket]);
+        }
+    }
+    mutex_unlock(&gpu->lock);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(latency);
+
+/**
+ * \brief           Usada pelo arquivo reset do debugfs, qualquer escrita zera os contadores da GPU
+ */
+static ssize_t reset_write(struct file *filep, const char __user *buffer, size_t len, loff_t *offset) {
+    struct gpu_dev *gpu = file_inode(filep)->i_private;
+
+    mutex_lock(&gpu->lock);
+    memset(gpu->perf.instructions, 0, sizeof(gpu->perf.instructions));
+    gpu->perf.stalls = 0;
+    gpu->perf.stall_ns = 0;
+    memset(gpu->perf.latency, 0, sizeof(gpu->perf.latency));
+    atomic64_set(&gpu->perf.bytes, 0);
+    atomic64_set(&gpu->perf.errors, 0);
+    mutex_unlock(&gpu->lock);
+    return len;
+}
+
+static const struct file_operations reset_fops = {
+    .owner = THIS_MODULE,
+    .write = reset_write,
+};
+
+/**
+ * \brief           Usada para liberar uma GPU criada por gpu_create()
+ *
+ * \param[in]       gpu: GPU a ser liberada, seus arquivos ja devem estar fechados
+ */
+static void gpu_destroy(struct gpu_dev *gpu) {
+    debugfs_remove_recursive(gpu->debugfs_dir);
+    if (gpu->device) {
+        device_destroy(gpu_class, MKDEV(major_number, gpu->index));
+    }
+    if (gpu->wq) {
+        destroy_workqueue(gpu->wq);
+    }
+    hrtimer_cancel(&gpu->fifo_timer);
+    if (gpu->LW_virtual) {
+        iounmap(gpu->LW_virtual);
+    }
+    vfree(gpu->target_position);
+    vfree(gpu->target_window);
+    kfree(gpu);
+}
+
+/**
+ * \brief           Usada para mapear a ponte de uma GPU e criar seu /dev/gpu_driverN
+ *
+ * \param[in]       index: N de /dev/gpu_driverN
+ * \param[in]       base: Endereço fisico da ponte da GPU
+ * \return          Retorna a GPU criada ou um ERR_PTR()
+ */
+static struct gpu_dev *gpu_create(int index, unsigned long base) {
+    struct gpu_dev *gpu = kzalloc(sizeof(*gpu), GFP_KERNEL);
+    struct device *device;
+    int lane;
+
+    if (!gpu) {
+        return ERR_PTR(-ENOMEM);
+    }
+
+    gpu->index = index;
+    mutex_init(&gpu->lock);
+    init_waitqueue_head(&gpu->fifo_wait);
+    init_waitqueue_head(&gpu->release_wait);
+    hrtimer_init(&gpu->fifo_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    gpu->fifo_timer.function = fifo_timer_callback;
+    gpu->fifo_credit_time = ktime_get();
+    INIT_LIST_HEAD(&gpu->kick_list);
+    for (lane = 0; lane < GPU_LANES; lane++) {
+        INIT_LIST_HEAD(&gpu->lane_lists[lane]);
+    }
+    spin_lock_init(&gpu->run_lock);
+    INIT_WORK(&gpu->arbiter_work, arbiter);
+
+    gpu->target_position = vzalloc(GPU_TARGETS * sizeof(*gpu->target_position));
+    gpu->target_window = vzalloc(GPU_TARGETS * sizeof(*gpu->target_window));
+    if (!gpu->target_position || !gpu->target_window) {
+        gpu_destroy(gpu);
+        return ERR_PTR(-ENOMEM);
+    }
+
+    gpu->LW_virtual = ioremap(base, LW_BRIDGE_SPAN);
+    if (!gpu->LW_virtual) {
+        printk(KERN_ALERT "Falha ao mapear a memória da GPU %d\n", index);
+        gpu_destroy(gpu);
+        return ERR_PTR(-ENOMEM);
+    }
+
+    gpu->DATA_A_PTR = (volatile int *) (gpu->LW_virtual + DATA_A);
+    gpu->DATA_B_PTR = (volatile int *) (gpu->LW_virtual + DATA_B);
+    gpu->START_PTR = (volatile int *) (gpu->LW_virtual + START);
+    gpu->WRFULL_PTR = (volatile int *) (gpu->LW_virtual + WRFULL);
+
+    gpu->wq = alloc_ordered_workqueue(DEVICE_NAME "%d", 0, index);
+    if (!gpu->wq) {
+        printk(KERN_ALERT "Falha ao criar a fila de trabalho\n");
+        gpu_destroy(gpu);
+        return ERR_PTR(-ENOMEM);
+    }
+
+    device = device_create(gpu_class, NULL, MKDEV(major_number, index), NULL, DEVICE_NAME "%d", index);
+    if (IS_ERR(device)) {
+        printk(KERN_ALERT "Falha ao criar o dispositivo\n");
+        gpu_destroy(gpu);
+        return ERR_CAST(device);
+    }
+    gpu->device = device;
+
+    /* Contadores em /sys/kernel/debug/gpu_driver/gpuN, a GPU funciona mesmo sem debugfs */
+    if (!IS_ERR_OR_NULL(debugfs_root)) {
+        char name[8];
+
+        snprintf(name, sizeof(name), "gpu%d", index);
+        gpu->debugfs_dir = debugfs_create_dir(name, debugfs_root);
+        debugfs_create_file("stats", 0444, gpu->debugfs_dir, gpu, &stats_fops);
+        debugfs_create_file("latency", 0444, gpu->debugfs_dir, gpu, &latency_fops);
+        debugfs_create_file("reset", 0200, gpu->debugfs_dir, gpu, &reset_fops);
+    }
+
+    return gpu;
+}
 
 static int __init my_module_init(void) {
-    LW_virtual = ioremap(LW_BRIDGE_BASE, LW_BRIDGE_SPAN);
+    int i;
+
+    if (nr_bases < 1 || nr_bases > GPU_MAX_DEVICES) {
+        printk(KERN_ALERT "Quantidade de GPUs inválida\n");
+        return -EINVAL;
+    }
+
     major_number = register_chrdev(0, DEVICE_NAME, &fops);
 
     printk(KERN_INFO "por favor\n");
@@ -257,37 +1628,38 @@ static int __init my_module_init(void) {
     }
 
     printk(KERN_INFO "Módulo carregado: classe do dispositivo criada corretamente\n");
-    gpu_device = device_create(gpu_class, NULL, MKDEV(major_number, 0), NULL, DEVICE_NAME);
-    if (IS_ERR(gpu_device)) {
-        class_destroy(gpu_class);
-        unregister_chrdev(major_number, DEVICE_NAME);
-        printk(KERN_ALERT "Falha ao criar o dispositivo\n");
-        return PTR_ERR(gpu_device);
-    }
 
-    LW_virtual = ioremap(LW_BRIDGE_BASE, LW_BRIDGE_SPAN);
-    if (!LW_virtual) {
-        device_destroy(gpu_class, MKDEV(major_number, 0));
-        class_unregister(gpu_class);
-        class_destroy(gpu_class);
-        unregister_chrdev(major_number, DEVICE_NAME);
-        printk(KERN_ALERT "Falha ao mapear a memória\n");
-        return -ENOMEM;
-    }
+    debugfs_root = debugfs_create_dir(DEVICE_NAME, NULL);
 
+    /* Uma GPU por endereço em bases, /dev/gpu_driver0 usa o primeiro */
+    for (i = 0; i < nr_bases; i++) {
+        struct gpu_dev *gpu = gpu_create(i, bases[i]);
+
+        if (IS_ERR(gpu)) {
+            while (--i >= 0) {
+                gpu_destroy(gpus[i]);
+            }
+            debugfs_remove_recursive(debugfs_root);
+            class_unregister(gpu_class);
+            class_destroy(gpu_class);
+            unregister_chrdev(major_number, DEVICE_NAME);
+            return PTR_ERR(gpu);
+        }
+        gpus[i] = gpu;
+    }
+    gpu_count = nr_bases;
 
-    DATA_A_PTR = (volatile int *) (LW_virtual + DATA_A);
-    DATA_B_PTR = (volatile int *) (LW_virtual + DATA_B);   
-    START_PTR = (volatile int *) (LW_virtual + START);
-    WRFULL_PTR = (volatile int *) (LW_virtual + WRFULL);
-    
     return 0;
 }
 
 
 static void __exit my_module_exit(void) {
-    iounmap(LW_virtual);
-    device_destroy(gpu_class, MKDEV(major_number, 0));
+    int i;
+
+    for (i = 0; i < gpu_count; i++) {
+        gpu_destroy(gpus[i]);
+    }
+    debugfs_remove_recursive(debugfs_root);
     class_unregister(gpu_class);
     class_destroy(gpu_class);
     unregister_chrdev(major_number, DEVICE_NAME);
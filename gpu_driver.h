@@ -0,0 +1,432 @@
+/**
+ * \file            gpu_driver.h
+ * \brief           Header com o formato dos comandos trocados entre a gpu_lib e o modulo gpu_driver
+ */
+
+
+/*
+ * Copyright (c) 2024 Pedro Henrique Araujo Almeida, Dermeval Neves de Oliveira Filho, Matheus
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE
+ * AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of library_name.
+ *
+ * Author:          Pedro Henrique ARAUJO ALMEIDA <phaalmeida1\gmail.com>
+ *                  Dermeval Neves de Oliveira Filho <dermevalneves\gmail.com>
+ *                  Matheus Mota Santos<matheuzwork\gmail.com>
+ */
+
+#ifndef GPU_DRIVER_H
+#define GPU_DRIVER_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdint.h>
+#endif
+#include <linux/ioctl.h>
+
+/* Tipos de comando (primeiro byte de cada comando enviado ao driver) */
+#define GPU_CMD_BACKGROUND_COLOR 0
+#define GPU_CMD_SPRITE 1
+#define GPU_CMD_BACKGROUND_BLOCK 2
+#define GPU_CMD_SPRITE_PIXEL 3
+#define GPU_CMD_POLYGON 4
+#define GPU_CMD_RAW 5                                /* Instrução ja montada (ver gpu_pack_raw()), sempre com GPU_COMMAND_SIZE bytes */
+#define GPU_CMD_FILL_BLOCKS 6                         /* Macro: pinta um retangulo de background blocks (ver gpu_pack_fill_blocks()) */
+#define GPU_CMD_CLEAR_SPRITES 7                       /* Macro: desativa uma faixa de registradores de sprite */
+#define GPU_CMD_CLEAR_POLYGONS 8                      /* Macro: zera uma faixa de poligonos */
+#define GPU_CMD_BATCH 0xB0
+
+/* Definição dos OPCODES das intruções */
+#define GPU_OPCODE_WBR 0b00
+#define GPU_OPCODE_WSM 0b01
+#define GPU_OPCODE_WBM 0b10
+#define GPU_OPCODE_DP 0b11
+
+/* Ponte da GPU: endereço fisico padrao e deslocamento de cada registrador */
+#define GPU_BRIDGE_BASE 0xFF200000
+#define GPU_BRIDGE_SPAN 0x00005000
+#define GPU_REG_DATA_A 0x80
+#define GPU_REG_DATA_B 0x70
+#define GPU_REG_START 0xc0
+#define GPU_REG_WRFULL 0xb0
+
+/* Tamanho das memorias da GPU */
+#define GPU_SPRITE_REGISTERS 32                      /* Registrador 0 é a cor do background */
+#define GPU_SPRITE_MEMORY_SIZE 12800                 /* 32 bitmaps de 20x20 pixels */
+#define GPU_BACKGROUND_BLOCKS 4800                   /* 80x60 blocos de 8x8 pixels */
+#define GPU_POLYGONS 16
+
+/* Bitmaps da memoria de sprites: GPU_SPRITE_SIZE x GPU_SPRITE_SIZE pixels, linha por linha */
+#define GPU_SPRITE_SIZE 20
+#define GPU_SPRITE_PIXELS (GPU_SPRITE_SIZE * GPU_SPRITE_SIZE)
+#define GPU_SPRITE_SLOTS (GPU_SPRITE_MEMORY_SIZE / GPU_SPRITE_PIXELS)
+
+/* Cor de 9 bits que torna transparente um pixel de sprite ou um background block */
+#define GPU_COLOR_TRANSPARENT 510
+
+/* Quantidade de alvos de escrita (registradores e posições de memoria) de todas as memorias */
+#define GPU_TARGETS (GPU_SPRITE_REGISTERS + GPU_SPRITE_MEMORY_SIZE + GPU_BACKGROUND_BLOCKS + GPU_POLYGONS)
+
+/* Tamanho fixo de cada comando dentro de um lote (o maior comando tem 7 bytes) */
+#define GPU_COMMAND_SIZE 8
+
+/* Quantidade maxima de comandos em um unico lote */
+#define GPU_BATCH_MAX_COMMANDS 0xFFFF
+
+/*
+ * Filas de prioridade: o driver mantem uma fila de latencia e uma de volume por arquivo.
+ * Quando as duas tem comandos, lane_ratio comandos de latencia sao enviados para cada
+ * instrução de volume, entao grandes cargas de blocos ou bitmaps nao atrasam os sprites.
+ * Por padrao a fila e escolhida pelo OPCODE de cada instrução.
+ */
+#define GPU_LANE_AUTO -1                             /* Escolhe a fila pelo OPCODE */
+#define GPU_LANE_LATENCY 0                           /* WBR (sprites e cor do background) e DP */
+#define GPU_LANE_BULK 1                              /* WBM e WSM */
+#define GPU_LANES 2
+
+/* Flags do cabeçalho de lote, sem elas vale a fila escolhida com GPU_IOC_SET_LANE */
+#define GPU_BATCH_LATENCY 0x01                       /* Todos os comandos do lote vao para a fila de latencia */
+#define GPU_BATCH_BULK 0x02                          /* Todos os comandos do lote vao para a fila de volume */
+
+/**
+ * \brief           Cabecalho de um lote de comandos.
+ *
+ * Um lote e enviado em um unico write() no formato: cabecalho seguido de
+ * `count` comandos de GPU_COMMAND_SIZE bytes, cada um no mesmo formato do
+ * comando avulso (com bytes nao usados completados com zero).
+ *
+ * write() retorna assim que os comandos sao copiados para a fila do arquivo no
+ * driver, o envio para a GPU acontece depois (ver struct gpu_fence). Os comandos de
+ * um write() formam um grupo: em cada fila de prioridade o driver nao envia comandos
+ * de outro arquivo no meio do grupo. Se a espera
+ * por espaço nessa fila for interrompida (O_NONBLOCK ou sinal) depois de parte do
+ * lote ter sido aceita, write() retorna o tamanho do cabeçalho mais o dos comandos
+ * aceitos, e o restante deve ser reenviado em um novo lote.
+ */
+struct gpu_batch_header {
+    uint8_t type;                                    /*!< Sempre GPU_CMD_BATCH. */
+    uint8_t flags;                                   /*!< 0, GPU_BATCH_LATENCY ou GPU_BATCH_BULK. */
+    uint16_t count;                                  /*!< Quantidade de comandos que seguem o cabecalho. */
+};
+
+/**
+ * \brief           Comando de tamanho fixo usado dentro de um lote.
+ */
+struct gpu_command {
+    uint8_t bytes[GPU_COMMAND_SIZE];                 /*!< Comando no formato avulso, byte 0 e o tipo. */
+};
+
+/**
+ * \brief           Instrução ja montada, exatamente como é escrita nas filas DATA_A e DATA_B.
+ */
+struct gpu_instruction {
+    uint32_t data_a;                                 /*!< OPCODE e endereçamento. */
+    uint32_t data_b;                                 /*!< Dados. */
+};
+
+/**
+ * \brief           Usada para montar a instrução WBR que muda a cor do background
+ */
+static inline struct gpu_instruction gpu_encode_background_color(uint8_t r, uint8_t g, uint8_t b) {
+    struct gpu_instruction instruction;
+
+    instruction.data_a = GPU_OPCODE_WBR;
+    instruction.data_b = ((b & 0b111) << 6) | ((g & 0b111) << 3) | (r & 0b111);
+    return instruction;
+}
+
+/**
+ * \brief           Usada para montar a instrução WBR que coloca um sprite na tela
+ */
+static inline struct gpu_instruction gpu_encode_sprite(uint8_t reg, uint16_t x, uint16_t y, uint16_t offset, uint8_t sp) {
+    struct gpu_instruction instruction;
+
+    instruction.data_a = ((reg & 0b11111) << 4) | GPU_OPCODE_WBR;
+    instruction.data_b = (offset & 0x1FF) | ((y & 0x3FF) << 9) | ((x & 0x3FF) << 19) | ((sp ? 1u : 0u) << 29);
+    return instruction;
+}
+
+/**
+ * \brief           Usada para montar a instrução WBM que muda a cor de um background block
+ */
+static inline struct gpu_instruction gpu_encode_background_block(uint16_t address, uint8_t r, uint8_t g, uint8_t b) {
+    struct gpu_instruction instruction;
+
+    instruction.data_a = ((uint32_t) (address & 0x1FFF) << 4) | GPU_OPCODE_WBM;
+    instruction.data_b = ((b & 0b111) << 6) | ((g & 0b111) << 3) | (r & 0b111);
+    return instruction;
+}
+
+/**
+ * \brief           Usada para montar a instrução WSM que muda a cor de um pixel da memoria de sprites
+ */
+static inline struct gpu_instruction gpu_encode_sprite_pixel(uint16_t address, uint8_t r, uint8_t g, uint8_t b) {
+    struct gpu_instruction instruction;
+
+    instruction.data_a = ((uint32_t) (address & 0x3FFF) << 4) | GPU_OPCODE_WSM;
+    instruction.data_b = ((b & 0b111) << 6) | ((g & 0b111) << 3) | (r & 0b111);
+    return instruction;
+}
+
+/**
+ * \brief           Usada para montar a instrução DP que coloca um poligono na tela
+ */
+static inline struct gpu_instruction gpu_encode_polygon(uint8_t address, uint16_t ref_x, uint16_t ref_y, uint8_t size,
+                                                        uint8_t r, uint8_t g, uint8_t b, uint8_t shape) {
+    struct gpu_instruction instruction;
+    uint32_t rgb = ((b & 0b111) << 6) | ((g & 0b111) << 3) | (r & 0b111);
+
+    instruction.data_a = ((address & 0b1111) << 4) | GPU_OPCODE_DP;
+    instruction.data_b = (rgb << 22) | ((size & 0b1111) << 18) | ((ref_y & 0x1FF) << 9) | (ref_x & 0x1FF);
+    if (shape) {
+        instruction.data_b |= 1u << 31;
+    }
+    return instruction;
+}
+
+/**
+ * \brief           Usada para verificar se uma instrução montada respeita os campos e endereços da GPU
+ * \return          Retorna 1 quando a instrução é valida e 0 caso contrario
+ */
+static inline int gpu_instruction_valid(struct gpu_instruction instruction) {
+    /* Indexados pelo OPCODE: WBR, WSM, WBM e DP */
+    static const uint32_t address_limit[4] = {GPU_SPRITE_REGISTERS, GPU_SPRITE_MEMORY_SIZE, GPU_BACKGROUND_BLOCKS, GPU_POLYGONS};
+    static const uint32_t data_mask[4] = {0x3FFFFFFF, 0x1FF, 0x1FF, 0xFFFFFFFF};
+    uint32_t opcode = instruction.data_a & 0b11;
+
+    return (instruction.data_a & 0b1100) == 0 &&
+           (instruction.data_a >> 4) < address_limit[opcode] &&
+           (instruction.data_b & ~data_mask[opcode]) == 0;
+}
+
+/**
+ * \brief           Usada para numerar o alvo de uma escrita entre todas as memorias da GPU
+ *
+ * Duas instruções com o mesmo alvo escrevem na mesma posição, entao so a ultima tem efeito.
+ *
+ * \param[in]       opcode: Memoria escrita (WBR, WSM, WBM ou DP)
+ * \param[in]       address: Posição dentro da memoria
+ * \return          Retorna o alvo entre 0 e GPU_TARGETS - 1, ou -1 se o endereço for invalido
+ */
+static inline int gpu_target(uint32_t opcode, uint32_t address) {
+    /* Indexados pelo OPCODE: WBR, WSM, WBM e DP */
+    static const uint32_t address_limit[4] = {GPU_SPRITE_REGISTERS, GPU_SPRITE_MEMORY_SIZE, GPU_BACKGROUND_BLOCKS, GPU_POLYGONS};
+    static const uint32_t first[4] = {
+        0,
+        GPU_SPRITE_REGISTERS,
+        GPU_SPRITE_REGISTERS + GPU_SPRITE_MEMORY_SIZE,
+        GPU_SPRITE_REGISTERS + GPU_SPRITE_MEMORY_SIZE + GPU_BACKGROUND_BLOCKS,
+    };
+
+    opcode &= 0b11;
+    if (address >= address_limit[opcode]) {
+        return -1;
+    }
+    return first[opcode] + address;
+}
+
+/**
+ * \brief           Usada para guardar uma instrução montada em um comando GPU_CMD_RAW
+ *
+ * DATA_A ocupa os bytes 1 a 3 e DATA_B os bytes 4 a 7, do byte mais significativo para o menos.
+ */
+static inline void gpu_pack_raw(struct gpu_command *command, struct gpu_instruction instruction) {
+    command->bytes[0] = GPU_CMD_RAW;
+    command->bytes[1] = instruction.data_a >> 16;
+    command->bytes[2] = instruction.data_a >> 8;
+    command->bytes[3] = instruction.data_a;
+    command->bytes[4] = instruction.data_b >> 24;
+    command->bytes[5] = instruction.data_b >> 16;
+    command->bytes[6] = instruction.data_b >> 8;
+    command->bytes[7] = instruction.data_b;
+}
+
+/**
+ * \brief           Usada para ler a instrução montada de um comando GPU_CMD_RAW
+ */
+static inline struct gpu_instruction gpu_unpack_raw(const struct gpu_command *command) {
+    struct gpu_instruction instruction;
+
+    instruction.data_a = ((uint32_t) command->bytes[1] << 16) | ((uint32_t) command->bytes[2] << 8) | command->bytes[3];
+    instruction.data_b = ((uint32_t) command->bytes[4] << 24) | ((uint32_t) command->bytes[5] << 16) |
+                         ((uint32_t) command->bytes[6] << 8) | command->bytes[7];
+    return instruction;
+}
+
+/**
+ * \brief           Usada para montar a macro que pinta um retangulo de background blocks com uma cor
+ *
+ * \param[out]      command: Comando preenchido
+ * \param[in]       column: Coluna do canto superior esquerdo
+ * \param[in]       line: Linha do canto superior esquerdo
+ * \param[in]       width: Quantidade de colunas
+ * \param[in]       height: Quantidade de linhas
+ */
+static inline void gpu_pack_fill_blocks(struct gpu_command *command, uint8_t column, uint8_t line, uint8_t width, uint8_t height,
+                                        uint8_t r, uint8_t g, uint8_t b) {
+    command->bytes[0] = GPU_CMD_FILL_BLOCKS;
+    command->bytes[1] = column;
+    command->bytes[2] = line;
+    command->bytes[3] = width;
+    command->bytes[4] = height;
+    command->bytes[5] = r;
+    command->bytes[6] = g;
+    command->bytes[7] = b;
+}
+
+/**
+ * \brief           Usada para montar a macro que desativa os registradores de sprite first ate first + count - 1
+ */
+static inline void gpu_pack_clear_sprites(struct gpu_command *command, uint8_t first, uint8_t count) {
+    command->bytes[0] = GPU_CMD_CLEAR_SPRITES;
+    command->bytes[1] = first;
+    command->bytes[2] = count;
+    command->bytes[3] = command->bytes[4] = command->bytes[5] = command->bytes[6] = command->bytes[7] = 0;
+}
+
+/**
+ * \brief           Usada para montar a macro que zera os poligonos first ate first + count - 1
+ */
+static inline void gpu_pack_clear_polygons(struct gpu_command *command, uint8_t first, uint8_t count) {
+    command->bytes[0] = GPU_CMD_CLEAR_POLYGONS;
+    command->bytes[1] = first;
+    command->bytes[2] = count;
+    command->bytes[3] = command->bytes[4] = command->bytes[5] = command->bytes[6] = command->bytes[7] = 0;
+}
+
+/**
+ * \brief           Usada para saber se um comando é uma macro
+ */
+static inline int gpu_is_macro(const struct gpu_command *command) {
+    return command->bytes[0] >= GPU_CMD_FILL_BLOCKS && command->bytes[0] <= GPU_CMD_CLEAR_POLYGONS;
+}
+
+/**
+ * \brief           Usada para verificar se os parametros de uma macro estao dentro das memorias da GPU
+ * \return          Retorna 1 quando a macro é valida e 0 caso contrario
+ */
+static inline int gpu_macro_valid(const struct gpu_command *command) {
+    const uint8_t *bytes = command->bytes;
+
+    switch (bytes[0]) {
+        case GPU_CMD_FILL_BLOCKS:
+            return bytes[1] + bytes[3] <= 80 && bytes[2] + bytes[4] <= 60 && bytes[5] <= 7 && bytes[6] <= 7 && bytes[7] <= 7;
+        case GPU_CMD_CLEAR_SPRITES:
+            return bytes[1] + bytes[2] <= GPU_SPRITE_REGISTERS;
+        case GPU_CMD_CLEAR_POLYGONS:
+            return bytes[1] + bytes[2] <= GPU_POLYGONS;
+        default:
+            return 0;
+    }
+}
+
+/**
+ * \brief           Usada para saber quantas instruções uma macro gera
+ */
+static inline uint32_t gpu_macro_length(const struct gpu_command *command) {
+    switch (command->bytes[0]) {
+        case GPU_CMD_FILL_BLOCKS:
+            return (uint32_t) command->bytes[3] * command->bytes[4];
+        case GPU_CMD_CLEAR_SPRITES:
+        case GPU_CMD_CLEAR_POLYGONS:
+            return command->bytes[2];
+        default:
+            return 0;
+    }
+}
+
+/**
+ * \brief           Usada para montar a instrução de numero index (de 0 ate gpu_macro_length() - 1) de uma macro
+ */
+static inline struct gpu_instruction gpu_macro_instruction(const struct gpu_command *command, uint32_t index) {
+    const uint8_t *bytes = command->bytes;
+
+    switch (bytes[0]) {
+        case GPU_CMD_FILL_BLOCKS: {
+            uint32_t column = bytes[1] + index % bytes[3];
+            uint32_t line = bytes[2] + index / bytes[3];
+            return gpu_encode_background_block(column + line * 80, bytes[5], bytes[6], bytes[7]);
+        }
+        case GPU_CMD_CLEAR_SPRITES:
+            return gpu_encode_sprite(bytes[1] + index, 0, 0, 0, 0);
+        default:
+            return gpu_encode_polygon(bytes[1] + index, 0, 0, 0, 0, 0, 0, 0);
+    }
+}
+
+/* Quantidade de comandos do anel compartilhado (deve ser potencia de 2) */
+#define GPU_RING_ENTRIES 2048
+
+/**
+ * \brief           Anel de comandos compartilhado entre a gpu_lib e o driver via mmap.
+ *
+ * A gpu_lib e a unica produtora: escreve o comando em commands[head % GPU_RING_ENTRIES]
+ * e depois avanca head. O driver e o unico consumidor: executa os comandos ate
+ * alcancar head e avanca tail. Os indices crescem livremente e so sao reduzidos
+ * ao acessar o vetor. Quando o anel esvazia o driver marca idle e para de consumir,
+ * e a gpu_lib precisa chamar GPU_IOC_DOORBELL apos publicar o proximo comando.
+ * Os comandos publicados em um unico avanço de head formam um grupo, que o driver
+ * nao intercala com comandos de outros arquivos (como os comandos de um write()).
+ */
+struct gpu_ring {
+    uint32_t head;                                   /*!< Proxima posicao a ser escrita pela gpu_lib. */
+    uint32_t reserved0[15];                          /*!< Mantem head e tail em linhas de cache diferentes. */
+    uint32_t tail;                                   /*!< Proxima posicao a ser lida pelo driver. */
+    uint32_t idle;                                   /*!< 1 quando o driver parou de consumir o anel. */
+    uint32_t reserved1[14];
+    struct gpu_command commands[GPU_RING_ENTRIES];   /*!< Comandos no mesmo formato usado nos lotes. */
+};
+
+/**
+ * \brief           Cerca que identifica todos os comandos enviados por um arquivo ate um momento.
+ *
+ * Obtida com GPU_IOC_FENCE e esperada com GPU_IOC_WAIT_FENCE, que so retorna quando
+ * todos os comandos anteriores a cerca (por write() e pelo anel, em todas as filas de
+ * prioridade) chegaram na GPU. fsync() tem o mesmo efeito que esperar uma cerca obtida na hora.
+ */
+struct gpu_fence {
+    uint32_t lanes[GPU_LANES];                       /*!< Sequencia dos comandos em cada fila de prioridade. */
+    uint32_t ring;                                   /*!< Sequencia dos comandos publicados no anel. */
+};
+
+/**
+ * \brief           Contadores de um arquivo aberto do driver, lidos com GPU_IOC_STATS.
+ *
+ * Enquanto a GPU estiver ocupada os comandos se acumulam na fila do driver. Quando
+ * varios comandos pendentes escrevem no mesmo alvo (registrador de sprite, bloco do
+ * background, poligono ou pixel da memoria de sprites) so o ultimo e enviado.
+ */
+struct gpu_stats {
+    uint64_t commands;                               /*!< Comandos consumidos (write() e anel), enviados ou descartados. */
+    uint64_t coalesced;                              /*!< Comandos descartados por serem sobrescritos por um posterior. */
+};
+
+/* Comandos de ioctl do driver */
+#define GPU_IOC_MAGIC 'G'
+#define GPU_IOC_DOORBELL _IO(GPU_IOC_MAGIC, 0)      /* Acorda o driver para consumir o anel */
+#define GPU_IOC_FENCE _IOR(GPU_IOC_MAGIC, 1, struct gpu_fence) /* Retorna uma cerca com os comandos enviados ate agora */
+#define GPU_IOC_WAIT_FENCE _IOW(GPU_IOC_MAGIC, 2, struct gpu_fence) /* Espera uma cerca ser alcançada */
+#define GPU_IOC_STATS _IOR(GPU_IOC_MAGIC, 3, struct gpu_stats) /* Retorna os contadores do arquivo */
+#define GPU_IOC_SET_LANE _IO(GPU_IOC_MAGIC, 4)      /* Fila padrao do arquivo (GPU_LANE_*), passada por valor */
+
+#endif /* GPU_DRIVER_H */
@@ -0,0 +1,391 @@
+/**
+ * \file            gpu_image.c
+ * \brief           Conversão de imagens RGB de 24 bits em bitmaps de sprites e mapas de background blocks
+ */
+
+/*
+ * Copyright (c) 2024 Pedro Henrique Araujo Almeida, Dermeval Neves de Oliveira Filho, Matheus
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE
+ * AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of library_name.
+ *
+ * Author:          Pedro Henrique ARAUJO ALMEIDA <phaalmeida1\gmail.com>
+ *                  Dermeval Neves de Oliveira Filho <dermevalneves\gmail.com>
+ *                  Matheus Mota Santos<matheuzwork\gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "gpu_image.h"
+
+/*
+ * Os componentes sao convertidos com vetores do GCC: o mesmo codigo vira NEON no ARM
+ * da placa e SSE/AVX no PC, e cai para codigo escalar onde nao ha SIMD.
+ */
+#define LANES 16
+typedef uint8_t u8_lanes __attribute__((vector_size(LANES)));
+typedef uint16_t u16_lanes __attribute__((vector_size(LANES * 2)));
+
+/* Matriz de Bayer 4x4 (0 a 15) do pontilhamento ordenado */
+static const uint8_t bayer[4][4] = {
+    { 0, 8, 2, 10 },
+    { 12, 4, 14, 6 },
+    { 3, 11, 1, 9 },
+    { 15, 7, 13, 5 },
+};
+
+/* Quantidade maxima de pixels de uma linha convertida de uma vez */
+#define MAX_ROW 4096
+
+/**
+ * \brief           Usada para converter componentes de 8 bits em niveis de 3 bits
+ *
+ * Cada nivel é floor((c * 7 + threshold) / 255): threshold 127 arredonda e os valores
+ * da matriz de Bayer pontilham. A divisão por 255 é exata para os valores usados.
+ *
+ * \param[in]       in: Componentes de 8 bits
+ * \param[in]       threshold: Limiar de cada componente, de 0 a 254
+ * \param[out]      out: Niveis de 0 a 7
+ * \param[in]       count: Quantidade de componentes
+ */
+static void quantize_components(const uint8_t *in, const uint8_t *threshold, uint8_t *out, size_t count) {
+    size_t i = 0;
+
+    for (; i + LANES <= count; i += LANES) {
+        u8_lanes value, limit;
+        u16_lanes x;
+
+        memcpy(&value, in + i, LANES);
+        memcpy(&limit, threshold + i, LANES);
+        x = __builtin_convertvector(value, u16_lanes) * 7 + __builtin_convertvector(limit, u16_lanes);
+        x = (x + 1 + (x >> 8)) >> 8;
+        value = __builtin_convertvector(x, u8_lanes);
+        memcpy(out + i, &value, LANES);
+    }
+    for (; i < count; i++) {
+        uint16_t x = in[i] * 7 + threshold[i];
+
+        out[i] = (x + 1 + (x >> 8)) >> 8;
+    }
+}
+
+/**
+ * \brief           Usada para juntar os niveis de R, G e B de cada pixel em uma cor de 9 bits
+ */
+static void pack_colors(const uint8_t *levels, uint16_t *colors, uint32_t count) {
+    uint32_t i;
+
+    for (i = 0; i < count; i++) {
+        colors[i] = levels[i * 3] | (levels[i * 3 + 1] << 3) | (levels[i * 3 + 2] << 6);
+    }
+}
+
+/**
+ * \brief           Usada para converter com Floyd-Steinberg, o erro de cada pixel vai para os vizinhos ainda nao convertidos
+ *
+ * Cada pixel depende do anterior, entao esta conversão é escalar.
+ *
+ * \return          Retorna 0 quando a operação não foi realizada, e 1 quando foi bem sucedida
+ */
+static int quantize_floyd(const uint8_t *rgb, uint32_t width, uint32_t height, uint32_t stride, uint16_t *colors) {
+    /* Valor de 8 bits de cada nivel */
+    static const int level_value[8] = { 0, 36, 73, 109, 146, 182, 219, 255 };
+    size_t row_size = ((size_t) width + 2) * 3;
+    int16_t *errors, *current, *next;
+    uint32_t x, y;
+    int c;
+
+    /* Erros da linha atual e da proxima, com um pixel a mais de cada lado */
+    errors = malloc(2 * row_size * sizeof(*errors));
+    if (errors == NULL) {
+        perror("Failed to convert the image");
+        return 0;
+    }
+    current = errors;
+    next = errors + row_size;
+
+    memset(current, 0, row_size * sizeof(*current));
+    for (y = 0; y < height; y++) {
+        const uint8_t *row = rgb + (size_t) y * stride;
+        /* Erro para o pixel da direita, fica fora da memoria para nao atrasar o proximo pixel */
+        int right[3] = { 0, 0, 0 };
+
+        memset(next, 0, row_size * sizeof(*next));
+        for (x = 0; x < width; x++) {
+            uint16_t color = 0;
+
+            for (c = 0; c < 3; c++) {
+                /* Erros guardados com 4 bits de fração, deslocados de um pixel para a esquerda existir */
+                int value = row[x * 3 + c] + ((current[(x + 1) * 3 + c] + right[c]) >> 4);
+                int level = value <= 0 ? 0 : value >= 255 ? 7 : (value * 7 + 127) / 255;
+                int error = value - level_value[level];
+
+                color |= level << (c * 3);
+                right[c] = error * 7;
+                next[x * 3 + c] += error * 3;
+                next[(x + 1) * 3 + c] += error * 5;
+                next[(x + 2) * 3 + c] += error;
+            }
+            colors[y * width + x] = color;
+        }
+        current = next;
+        next = current == errors ? errors + row_size : errors;
+    }
+    free(errors);
+    return 1;
+}
+
+/**
+ * \brief           Usada para converter um retangulo de pixels de 24 bits em cores de 9 bits (GPU_COLOR())
+ *
+ * \param[in]       rgb: Primeiro pixel do retangulo
+ * \param[in]       width: Largura do retangulo, no maximo 4096 pixels sem GPU_DITHER_FLOYD
+ * \param[in]       height: Altura do retangulo
+ * \param[in]       stride: Bytes entre o inicio de duas linhas
+ * \param[in]       dither: GPU_DITHER_NONE, GPU_DITHER_ORDERED ou GPU_DITHER_FLOYD
+ * \param[out]      colors: width * height cores, linha por linha
+ * \return          Retorna 0 quando a operação não foi realizada, e 1 quando foi bem sucedida
+ */
+int gpu_image_quantize(const uint8_t *rgb, uint32_t width, uint32_t height, uint32_t stride, int dither, uint16_t *colors) {
+    uint8_t threshold[MAX_ROW * 3], levels[MAX_ROW * 3];
+    uint32_t x, y;
+
+    if (dither == GPU_DITHER_FLOYD) {
+        return quantize_floyd(rgb, width, height, stride, colors);
+    }
+    if (width > MAX_ROW) {
+        fprintf(stderr, "As linhas da imagem devem ter no maximo %d pixels\n", MAX_ROW);
+        return 0;
+    }
+
+    memset(threshold, 127, width * 3);
+    for (y = 0; y < height; y++) {
+        if (dither == GPU_DITHER_ORDERED) {
+            for (x = 0; x < width; x++) {
+                /* Limiares de 8 a 248, com media 128 */
+                threshold[x * 3] = threshold[x * 3 + 1] = threshold[x * 3 + 2] = bayer[y & 3][x & 3] * 16 + 8;
+            }
+        }
+        quantize_components(rgb + (size_t) y * stride, threshold, levels, width * 3);
+        pack_colors(levels, colors + (size_t) y * width, width);
+    }
+    return 1;
+}
+
+/**
+ * \brief           Usada para ler um numero do cabeçalho de uma imagem PPM, pulando espaços e comentarios
+ * \return          Retorna o numero lido, ou -1 quando o cabeçalho é invalido
+ */
+static int read_ppm_number(FILE *file) {
+    int c, value;
+
+    while ((c = fgetc(file)) != EOF) {
+        if (c == '#') {
+            while ((c = fgetc(file)) != EOF && c != '\n') {
+            }
+        } else if (c != ' ' && c != '\t' && c != '\n' && c != '\r') {
+            ungetc(c, file);
+            break;
+        }
+    }
+    return fscanf(file, "%d", &value) == 1 ? value : -1;
+}
+
+/**
+ * \brief           Usada para ler uma imagem PPM binaria (P6) com componentes de 8 bits
+ *
+ * \param[in]       path: Caminho da imagem
+ * \param[out]      image: Imagem lida, liberada com gpu_image_free()
+ * \return          Retorna 0 quando a operação não foi realizada, e 1 quando foi bem sucedida
+ */
+int gpu_image_read_ppm(const char *path, struct gpu_image *image) {
+    char magic[3] = { 0 };
+    int width, height, maxval;
+    size_t size;
+    FILE *file;
+
+    memset(image, 0, sizeof(*image));
+    file = fopen(path, "rb");
+    if (file == NULL) {
+        perror(path);
+        return 0;
+    }
+    if (fread(magic, 1, 2, file) != 2 || strcmp(magic, "P6") != 0) {
+        fprintf(stderr, "%s: somente imagens PPM binarias (P6) sao aceitas\n", path);
+        fclose(file);
+        return 0;
+    }
+    width = read_ppm_number(file);
+    height = read_ppm_number(file);
+    maxval = read_ppm_number(file);
+    if (width <= 0 || height <= 0 || maxval != 255) {
+        fprintf(stderr, "%s: a imagem deve ter componentes de 8 bits\n", path);
+        fclose(file);
+        return 0;
+    }
+    /* Com size_t de 32 bits na placa, width * height * 3 daria a volta e o buffer ficaria pequeno */
+    if ((size_t) width > SIZE_MAX / 3 / (size_t) height) {
+        fprintf(stderr, "%s: imagem grande demais\n", path);
+        fclose(file);
+        return 0;
+    }
+    /* Um unico espaço separa o cabeçalho dos pixels */
+    fgetc(file);
+
+    image->width = width;
+    image->height = height;
+    size = (size_t) width * height * 3;
+    image->rgb = malloc(size);
+    if (image->rgb == NULL || fread(image->rgb, 1, size, file) != size) {
+        fprintf(stderr, "%s: imagem incompleta\n", path);
+        gpu_image_free(image);
+        fclose(file);
+        return 0;
+    }
+    fclose(file);
+    return 1;
+}
+
+/**
+ * \brief           Usada para liberar uma imagem lida por gpu_image_read_ppm()
+ */
+void gpu_image_free(struct gpu_image *image) {
+    free(image->rgb);
+    image->rgb = NULL;
+    image->width = image->height = 0;
+}
+
+/**
+ * \brief           Usada para converter um trecho de 20x20 pixels de uma imagem em um bitmap de sprite
+ *
+ * Pixels com a cor key ficam transparentes. Como a GPU trata GPU_COLOR_TRANSPARENT como
+ * transparente, os outros pixels que caem nela viram a cor branca mais proxima.
+ *
+ * \param[in]       image: Imagem de origem
+ * \param[in]       x: Coluna do canto superior esquerdo do trecho
+ * \param[in]       y: Linha do canto superior esquerdo do trecho
+ * \param[in]       dither: GPU_DITHER_NONE, GPU_DITHER_ORDERED ou GPU_DITHER_FLOYD
+ * \param[in]       key: Cor transparente em 0xRRGGBB, ou GPU_IMAGE_NO_KEY
+ * \param[out]      pixels: Bitmap para upload_sprite_bitmap()
+ * \return          Retorna 0 quando o trecho sai da imagem, e 1 quando foi bem sucedida
+ */
+int gpu_image_sprite(const struct gpu_image *image, uint32_t x, uint32_t y, int dither, int32_t key,
+                     uint16_t pixels[GPU_SPRITE_PIXELS]) {
+    const uint8_t *origin;
+    int row, column;
+
+    if (x + GPU_SPRITE_SIZE > image->width || y + GPU_SPRITE_SIZE > image->height) {
+        fprintf(stderr, "O sprite em %u,%u sai da imagem de %ux%u pixels\n", x, y, image->width, image->height);
+        return 0;
+    }
+
+    origin = image->rgb + ((size_t) y * image->width + x) * 3;
+    if (!gpu_image_quantize(origin, GPU_SPRITE_SIZE, GPU_SPRITE_SIZE, image->width * 3, dither, pixels)) {
+        return 0;
+    }
+    for (row = 0; row < GPU_SPRITE_SIZE; row++) {
+        for (column = 0; column < GPU_SPRITE_SIZE; column++) {
+            const uint8_t *rgb = origin + ((size_t) row * image->width + column) * 3;
+            uint16_t *pixel = &pixels[row * GPU_SPRITE_SIZE + column];
+
+            if (key != GPU_IMAGE_NO_KEY && (rgb[0] << 16 | rgb[1] << 8 | rgb[2]) == key) {
+                *pixel = GPU_COLOR_TRANSPARENT;
+            } else if (*pixel == GPU_COLOR_TRANSPARENT) {
+                *pixel = GPU_COLOR_TRANSPARENT + 1;
+            }
+        }
+    }
+    return 1;
+}
+
+/**
+ * \brief           Usada para converter uma imagem inteira em um mapa de 80x60 background blocks
+ *
+ * Cada bloco recebe a media dos pixels que cobre, entao qualquer resolução serve; uma
+ * imagem de 640x480 tem exatamente 8x8 pixels por bloco. As linhas sao somadas com
+ * vetores antes da media de cada bloco.
+ *
+ * \param[in]       image: Imagem de origem, com pelo menos 80x60 pixels
+ * \param[in]       dither: GPU_DITHER_NONE, GPU_DITHER_ORDERED ou GPU_DITHER_FLOYD
+ * \param[out]      blocks: Cores dos blocos linha por linha, para gpu_asset_background()
+ * \return          Retorna 0 quando a operação não foi realizada, e 1 quando foi bem sucedida
+ */
+int gpu_image_background(const struct gpu_image *image, int dither, uint16_t blocks[GPU_BACKGROUND_BLOCKS]) {
+    uint8_t average[GPU_BACKGROUND_BLOCKS * 3];
+    uint32_t line, column, x, y;
+    uint16_t *sums;
+    size_t width = (size_t) image->width * 3;
+
+    /* Com no maximo MAX_ROW linhas, a soma de um bloco cabe em 16 bits */
+    if (image->width < 80 || image->height < 60 || image->width > MAX_ROW || image->height > MAX_ROW) {
+        fprintf(stderr, "A imagem do background deve ter entre 80x60 e %dx%d pixels\n", MAX_ROW, MAX_ROW);
+        return 0;
+    }
+    sums = malloc(width * sizeof(*sums));
+    if (sums == NULL) {
+        perror("Failed to convert the image");
+        return 0;
+    }
+
+    for (line = 0; line < 60; line++) {
+        uint32_t top = line * image->height / 60, bottom = (line + 1) * image->height / 60;
+
+        /* Soma vertical das linhas do bloco, um componente por posição */
+        memset(sums, 0, width * sizeof(*sums));
+        for (y = top; y < bottom; y++) {
+            const uint8_t *row = image->rgb + y * width;
+            size_t i = 0;
+
+            for (; i + LANES <= width; i += LANES) {
+                u8_lanes value;
+                u16_lanes sum;
+
+                memcpy(&value, row + i, LANES);
+                memcpy(&sum, sums + i, sizeof(sum));
+                sum += __builtin_convertvector(value, u16_lanes);
+                memcpy(sums + i, &sum, sizeof(sum));
+            }
+            for (; i < width; i++) {
+                sums[i] += row[i];
+            }
+        }
+
+        for (column = 0; column < 80; column++) {
+            uint32_t left = column * image->width / 80, right = (column + 1) * image->width / 80;
+            uint32_t total[3] = { 0, 0, 0 }, count = (right - left) * (bottom - top);
+
+            for (x = left; x < right; x++) {
+                total[0] += sums[x * 3];
+                total[1] += sums[x * 3 + 1];
+                total[2] += sums[x * 3 + 2];
+            }
+            average[(line * 80 + column) * 3] = (total[0] + count / 2) / count;
+            average[(line * 80 + column) * 3 + 1] = (total[1] + count / 2) / count;
+            average[(line * 80 + column) * 3 + 2] = (total[2] + count / 2) / count;
+        }
+    }
+    free(sums);
+
+    return gpu_image_quantize(average, 80, 60, 80 * 3, dither, blocks);
+}
@@ -0,0 +1,72 @@
+/**
+ * \file            gpu_image.h
+ * \brief           Conversão de imagens RGB de 24 bits para as cores de 9 bits da GPU
+ */
+
+/*
+ * Copyright (c) 2024 Pedro Henrique Araujo Almeida, Dermeval Neves de Oliveira Filho, Matheus
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE
+ * AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of library_name.
+ *
+ * Author:          Pedro Henrique ARAUJO ALMEIDA <phaalmeida1\gmail.com>
+ *                  Dermeval Neves de Oliveira Filho <dermevalneves\gmail.com>
+ *                  Matheus Mota Santos<matheuzwork\gmail.com>
+ */
+
+#ifndef GPU_IMAGE_H
+#define GPU_IMAGE_H
+
+#include <stdint.h>
+#include "gpu_driver.h"
+
+/* Pontilhamento usado na conversão para 3 bits por componente */
+#define GPU_DITHER_NONE 0                            /* Arredonda cada componente para o nivel mais proximo */
+#define GPU_DITHER_ORDERED 1                         /* Matriz de Bayer 4x4, sem dependencia entre pixels */
+#define GPU_DITHER_FLOYD 2                           /* Floyd-Steinberg, espalha o erro para os vizinhos */
+
+/* Sem cor transparente em gpu_image_sprite() */
+#define GPU_IMAGE_NO_KEY (-1)
+
+/**
+ * \brief           Imagem RGB de 24 bits, linha por linha, 3 bytes por pixel (R, G e B)
+ *
+ * Preenchida por gpu_image_read_ppm() ou diretamente com um buffer do programa.
+ */
+struct gpu_image {
+    uint32_t width;                                  /*!< Largura em pixels. */
+    uint32_t height;                                 /*!< Altura em pixels. */
+    uint8_t *rgb;                                    /*!< width * height * 3 bytes. */
+};
+
+int gpu_image_read_ppm(const char *path, struct gpu_image *image);
+
+void gpu_image_free(struct gpu_image *image);
+
+int gpu_image_quantize(const uint8_t *rgb, uint32_t width, uint32_t height, uint32_t stride, int dither, uint16_t *colors);
+
+int gpu_image_sprite(const struct gpu_image *image, uint32_t x, uint32_t y, int dither, int32_t key,
+                     uint16_t pixels[GPU_SPRITE_PIXELS]);
+
+int gpu_image_background(const struct gpu_image *image, int dither, uint16_t blocks[GPU_BACKGROUND_BLOCKS]);
+
+#endif /* GPU_IMAGE_H */
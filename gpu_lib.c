@@ -36,177 +36,2453 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "gpu_lib.h"
+#include "gpu_driver.h"
+
+/* Quantidade de comandos acumulados no lote antes de ser enviado ao driver */
+#define BATCH_CAPACITY 1024
 
 int fd = 0;
 
 /**
- * \brief           Usada para abrir o arquivo do driver da GPU
- *  \return         Retorna 1 caso o arquivo foi aberto ou retorna 0 caso não seja possivel abrir o arquivo
+ * \brief           Estado de uma GPU aberta, cada /dev/gpu_driverN tem o seu
+ */
+struct gpu_device {
+    const Gpu_Backend *backend;                      /*!< Transporte usado para chegar na GPU. */
+    char *path;                                      /*!< Caminho passado ao transporte, NULL quando nenhum. */
+    int fd;                                          /*!< Arquivo do driver (ou /dev/mem) aberto, -1 no simulador. */
+    int batch_depth;                                 /*!< Quantidade de gpu_begin_batch() sem gpu_submit_batch() correspondente. */
+    uint16_t batch_count;                            /*!< Quantidade de comandos acumulados no lote. */
+    unsigned char batch_buffer[sizeof(struct gpu_batch_header) + BATCH_CAPACITY * GPU_COMMAND_SIZE];
+    struct gpu_ring *ring;                           /*!< Anel compartilhado com o driver, NULL quando o driver nao suporta mmap. */
+    uint32_t ring_head;                              /*!< Proxima posição do anel, publicada em ring->head fora dos lotes. */
+    void *bridge;                                    /*!< Ponte da GPU mapeada pelo transporte direto. */
+    struct gpu_sim *sim;                             /*!< Estado do simulador. */
+    uint64_t commands;                               /*!< Comandos executados pelos transportes sem driver. */
+    uint32_t shadow[GPU_TARGETS];                    /*!< Ultimo DATA_B escrito em cada alvo (ver gpu_target()). */
+    uint32_t shadow_known[(GPU_TARGETS + 31) / 32];  /*!< Alvos cujo valor em shadow é o da GPU. */
+    uint64_t elided;                                 /*!< Instruções descartadas por nao mudarem a GPU. */
+    char *atlas_state;                               /*!< Arquivo com os bitmaps residentes, ver gpu_load_atlas(). */
+    uint32_t atlas_resident;                         /*!< Slots cujo hash em atlas_hashes é o conteudo da GPU. */
+    uint64_t atlas_hashes[GPU_SPRITE_SLOTS];         /*!< Hash de cada slot carregado pelo atlas. */
+    uint32_t asset_generation;                       /*!< Ultima asset_generation aplicada em shadow_known. */
+    struct bitmap_cache *bitmaps;                    /*!< Bitmaps logicos de set_sprite_bitmap(), NULL ate o primeiro. */
+};
+
+/**
+ * \brief           Bitmap criado com gpu_bitmap_create()
+ */
+struct logical_bitmap {
+    uint16_t pixels[GPU_SPRITE_PIXELS];              /*!< Copia dos pixels, reenviada quando o bitmap volta para a GPU. */
+    int slot;                                        /*!< Slot da memoria de sprites com o bitmap, -1 quando fora da GPU. */
+    int alive;                                       /*!< 0 depois de gpu_bitmap_destroy(), a posição é reaproveitada. */
+    int pinned;                                      /*!< Diferente de 0 quando o slot nao pode ser substituido (animações). */
+    uint64_t last_use;                               /*!< Valor de tick no ultimo set_sprite_bitmap() com o bitmap. */
+};
+
+/**
+ * \brief           Distribuição dos bitmaps logicos nos slots da memoria de sprites de uma GPU
+ */
+struct bitmap_cache {
+    uint32_t reserved;                               /*!< Slots que podem ser usados, ver gpu_bitmap_reserve(). */
+    int owner[GPU_SPRITE_SLOTS];                     /*!< Bitmap logico em cada slot, -1 quando livre. */
+    uint64_t tick;                                   /*!< Contador de usos, ordena os bitmaps para a substituição. */
+    uint32_t count;                                  /*!< Posições usadas em entries. */
+    uint32_t capacity;                               /*!< Posições alocadas em entries. */
+    struct logical_bitmap *entries;
+};
+
+/* Identifica o arquivo de estado do atlas */
+#define ATLAS_STATE_MAGIC 0x53555047
+
+/**
+ * \brief           Arquivo com os bitmaps que o atlas deixou na memoria de sprites
+ *
+ * A memoria de sprites so se perde quando a placa é desligada ou reprogramada, entao
+ * o estado é descartado quando o boot_id do sistema muda.
+ */
+struct atlas_state {
+    uint32_t magic;                                  /*!< Sempre ATLAS_STATE_MAGIC. */
+    uint32_t resident;                               /*!< Slots cujo hash é o conteudo da GPU. */
+    char boot_id[40];                                /*!< /proc/sys/kernel/random/boot_id quando o estado foi gravado. */
+    uint64_t hashes[GPU_SPRITE_SLOTS];               /*!< Hash de cada slot residente. */
+};
+
+/**
+ * \brief           Transporte da gpu_lib ate a GPU
+ *
+ * O transporte recebe os comandos no formato dos lotes. Os transportes sem driver
+ * expandem os comandos em instruções e as escrevem com write_instruction.
+ */
+struct gpu_backend {
+    const char *name;                                /*!< Nome do transporte. */
+    int (*open)(Gpu_Device *gpu, const char *path);  /*!< Abre a GPU, retorna 1 quando bem sucedido. */
+    void (*close)(Gpu_Device *gpu);
+    int (*send)(Gpu_Device *gpu, const unsigned char *command, size_t len); /*!< Envia um comando ou o acumula no lote aberto. */
+    int (*flush)(Gpu_Device *gpu);                   /*!< Envia os comandos acumulados no lote. */
+    int (*control)(Gpu_Device *gpu, unsigned long request, unsigned long arg); /*!< Comandos GPU_IOC_*, retorna -1 na falha. */
+    int (*sync)(Gpu_Device *gpu);                    /*!< Espera os comandos enviados chegarem na GPU, retorna -1 na falha. */
+    int (*write_instruction)(Gpu_Device *gpu, struct gpu_instruction instruction); /*!< So nos transportes sem driver. */
+};
+
+static Gpu_Device default_device = { .fd = -1 };     /* GPU aberta por open_gpu_device() */
+static __thread Gpu_Device *device = &default_device; /* GPU usada pelas funções da biblioteca nesta thread */
+
+/*
+ * Rastreamento: anel de registros compartilhado por todas as threads. Cada registro
+ * reserva uma posição com um incremento atomico de trace_next e grava sequence por
+ * ultimo, entao gpu_trace_dump() descarta registros sobrescritos ou incompletos.
+ * Com o rastreamento desligado trace_entries é NULL e o custo é uma comparação.
+ */
+static struct gpu_trace_entry *trace_entries;
+static uint32_t trace_mask;
+static uint64_t trace_next;
+
+/*
+ * Gravação: os registros sao escritos em record_file por todas as threads, uma de
+ * cada vez (record_lock). Com a gravação desligada record_file é NULL e o custo é
+ * uma comparação.
+ */
+static FILE *record_file;
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t record_last_ns;                      /* Instante do registro anterior */
+
+/* Tipos de carregamento da fila de assets */
+#define ASSET_SPRITE 0
+#define ASSET_BACKGROUND 1
+#define ASSET_CALL 2
+
+/**
+ * \brief           Carregamento esperando a thread de assets
+ */
+struct asset_job {
+    int id;                                          /*!< Numero retornado por gpu_asset_*. */
+    int type;                                        /*!< ASSET_SPRITE, ASSET_BACKGROUND ou ASSET_CALL. */
+    uint8_t slot;                                    /*!< Slot de ASSET_SPRITE. */
+    uint32_t slots;                                  /*!< Slots da memoria de sprites escritos pelo carregamento. */
+    uint16_t *data;                                  /*!< Copia do bitmap ou do mapa de blocos. */
+    void (*load)(void);                              /*!< Função de ASSET_CALL. */
+    struct asset_job *next;
+};
+
+/*
+ * Assets: uma thread envia os carregamentos por uma segunda GPU aberta no mesmo
+ * arquivo (asset_worker), na fila de volume do driver, enquanto a thread que os pediu
+ * continua desenhando em asset_owner. Depois de cada carregamento os alvos escritos
+ * sao marcados em asset_dirty e asset_generation muda; asset_owner os tira da sua
+ * copia do estado antes do proximo envio. Tudo protegido por asset_lock; asset_start_lock
+ * so serializa a criação e o fim da thread, que abrem e fecham arquivos.
+ */
+static pthread_mutex_t asset_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t asset_start_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t asset_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t asset_thread;
+static Gpu_Device *asset_owner;
+static Gpu_Device *asset_worker;
+static struct asset_job *asset_head, *asset_tail;
+static int asset_next_id;
+static int asset_stopping;
+static signed char *asset_results;                   /* Por asset: 0 pendente, 1 carregado, -1 falhou */
+static uint8_t asset_pending[GPU_SPRITE_SLOTS];      /* Carregamentos na fila que escrevem em cada slot */
+static uint32_t asset_failed;                        /* Slots cujo ultimo carregamento falhou */
+static uint32_t asset_dirty[(GPU_TARGETS + 31) / 32];
+static uint32_t asset_generation;
+
+/**
+ * \brief           Usada para ler o relogio monotonico em nanossegundos
+ */
+static uint64_t now_ns() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+/**
+ * \brief           Usada para gravar um registro no anel de rastreamento
+ *
+ * \param[in]       type: GPU_TRACE_COMMAND ou GPU_TRACE_FRAME
+ * \param[in]       command: Comando no formato avulso, NULL em GPU_TRACE_FRAME
+ * \param[in]       len: Tamanho do comando em bytes
+ * \param[in]       result: Retorno do envio do comando
+ */
+static void trace_record(uint16_t type, const unsigned char *command, size_t len, int result) {
+    struct gpu_trace_entry *entries = __atomic_load_n(&trace_entries, __ATOMIC_ACQUIRE);
+    struct gpu_trace_entry *entry;
+    uint64_t sequence;
+
+    if (entries == NULL) {
+        return;
+    }
+
+    sequence = __atomic_fetch_add(&trace_next, 1, __ATOMIC_RELAXED);
+    entry = &entries[sequence & trace_mask];
+    __atomic_store_n(&entry->sequence, 0, __ATOMIC_RELAXED); /* Marca o registro como incompleto */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    entry->time_ns = now_ns();
+    memset(&entry->command, 0, sizeof(entry->command));
+    if (command != NULL) {
+        memcpy(entry->command.bytes, command, len);
+    }
+    entry->type = type;
+    entry->length = len;
+    entry->result = result;
+    __atomic_store_n(&entry->sequence, sequence + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * \brief           Usada para gravar um registro no arquivo de gravação
+ *
+ * Marcas de quadro esvaziam o buffer do arquivo, entao uma gravação interrompida
+ * perde no maximo o quadro atual.
+ *
+ * \param[in]       type: Um dos GPU_RECORD_*
+ * \param[in]       command: Comando no formato avulso, NULL nos outros tipos
+ * \param[in]       len: Tamanho do comando em bytes
+ */
+static void record(uint16_t type, const unsigned char *command, size_t len) {
+    struct gpu_record_entry entry;
+    uint64_t now;
+
+    pthread_mutex_lock(&record_lock);
+
+    if (record_file != NULL) {
+        now = now_ns();
+        entry.delta_ns = now - record_last_ns > UINT32_MAX ? UINT32_MAX : now - record_last_ns;
+        entry.type = type;
+        entry.length = command != NULL ? len : 0;
+        record_last_ns = now;
+
+        fwrite(&entry, sizeof(entry), 1, record_file);
+        fwrite(command, 1, entry.length, record_file);
+        if (type == GPU_RECORD_FRAME) {
+            fflush(record_file);
+        }
+    }
+    pthread_mutex_unlock(&record_lock);
+}
+
+/**
+ * \brief           Usada para acumular um comando no lote aberto, enviando o lote quando enche
+ * \return          Retorna 1 quando o comando foi acumulado, e 0 quando ocorreu uma falha
+ */
+static int batch_append(Gpu_Device *gpu, const unsigned char *command, size_t len) {
+    unsigned char *slot = gpu->batch_buffer + sizeof(struct gpu_batch_header) + gpu->batch_count * GPU_COMMAND_SIZE;
+
+    memset(slot, 0, GPU_COMMAND_SIZE);
+    memcpy(slot, command, len);
+    gpu->batch_count++;
+
+    if (gpu->batch_count == BATCH_CAPACITY) {
+        return gpu->backend->flush(gpu);
+    }
+    return 1;
+}
+
+/**
+ * \brief           Usada para publicar para o driver os comandos escritos no anel
+ *
+ * Os comandos publicados juntos formam um grupo que o driver nao intercala com outros processos.
+ *
+ * \return          Retorna 1 quando os comandos foram publicados, e 0 quando ocorreu uma falha
+ */
+static int ring_publish(Gpu_Device *gpu) {
+    if (gpu->ring->head == gpu->ring_head) {
+        return 1;
+    }
+    __atomic_store_n(&gpu->ring->head, gpu->ring_head, __ATOMIC_RELEASE);
+
+    /* Publica head antes de ler idle, o driver faz o inverso antes de parar */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&gpu->ring->idle, __ATOMIC_ACQUIRE) && ioctl(gpu->fd, GPU_IOC_DOORBELL) < 0) {
+        perror("Failed to write to the device");
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * \brief           Usada para colocar um comando no anel compartilhado sem chamada de sistema
+ *
+ * So chama o driver (GPU_IOC_DOORBELL) quando ele parou de consumir o anel, e espera
+ * caso o anel esteja cheio. Dentro de um lote o comando so e publicado em gpu_submit_batch().
+ *
+ * \param[in]       command: Comando no formato avulso
+ * \param[in]       len: Tamanho do comando em bytes
+ * \return          Retorna 1 quando o comando foi publicado, e 0 quando ocorreu uma falha
+ */
+static int ring_push(Gpu_Device *gpu, const unsigned char *command, size_t len) {
+    struct gpu_command *slot;
+
+    /* Anel cheio: publica o que ja foi escrito (dividindo o lote), garante que o driver esta consumindo e espera */
+    while (gpu->ring_head - __atomic_load_n(&gpu->ring->tail, __ATOMIC_ACQUIRE) >= GPU_RING_ENTRIES) {
+        if (!ring_publish(gpu)) {
+            return 0;
+        }
+        if (__atomic_load_n(&gpu->ring->idle, __ATOMIC_ACQUIRE) && ioctl(gpu->fd, GPU_IOC_DOORBELL) < 0) {
+            perror("Failed to write to the device");
+            return 0;
+        }
+        usleep(100);
+    }
+
+    slot = &gpu->ring->commands[gpu->ring_head & (GPU_RING_ENTRIES - 1)];
+    memset(slot, 0, sizeof(*slot));
+    memcpy(slot->bytes, command, len);
+    gpu->ring_head++;
+
+    if (gpu->batch_depth > 0) {
+        return 1;
+    }
+    return ring_publish(gpu);
+}
+
+/**
+ * \brief           Usada para abrir o arquivo do driver de uma GPU e mapear seu anel de comandos
+ *
+ * \param[in]       path: Caminho do arquivo do driver
+ * \return          Retorna 1 caso o arquivo foi aberto ou retorna 0 caso não seja possivel abrir o arquivo
+ */
+static int chardev_open(Gpu_Device *gpu, const char *path) {
+    void *shared;
+
+    gpu->fd = open(path, O_RDWR);
+    if (gpu->fd < 0) {
+        gpu->fd = open(path, O_WRONLY);
+    }
+
+    if (gpu->fd < 0) {
+        perror("Failed to open the device");
+        return 0;
+    }
+
+    /* Usa o anel compartilhado quando o driver permite, senao os comandos seguem por write() */
+    shared = mmap(NULL, sizeof(struct gpu_ring), PROT_READ | PROT_WRITE, MAP_SHARED, gpu->fd, 0);
+    gpu->ring = (shared == MAP_FAILED) ? NULL : shared;
+    return 1;
+}
+
+/**
+ * \brief           Usada para liberar o anel e fechar o arquivo do driver de uma GPU
+ */
+static void chardev_close(Gpu_Device *gpu) {
+    if (gpu->ring != NULL) {
+        munmap(gpu->ring, sizeof(struct gpu_ring));
+        gpu->ring = NULL;
+    }
+    close(gpu->fd);
+}
+
+/**
+ * \brief           Usada para enviar um comando ao driver pelo anel ou por write(), ou acumular no lote
+ */
+static int chardev_send(Gpu_Device *gpu, const unsigned char *command, size_t len) {
+    ssize_t written;
+
+    if (gpu->ring != NULL) {
+        return ring_push(gpu, command, len);
+    }
+
+    if (gpu->batch_depth > 0) {
+        return batch_append(gpu, command, len);
+    }
+
+    /* O driver aceita o comando inteiro ou nenhum byte dele */
+    do {
+        written = write(gpu->fd, command, len);
+    } while (written < 0 && errno == EINTR);
+    if (written != (ssize_t) len) {
+        perror("Failed to write to the device");
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * \brief           Usada para enviar ao driver todos os comandos acumulados no lote em um unico write(),
+ *                  ou publicar os comandos escritos no anel
+ * \return          Retorna 1 quando o lote foi enviado, e 0 quando ocorreu uma falha
+ */
+static int chardev_flush(Gpu_Device *gpu) {
+    struct gpu_batch_header header;
+    uint32_t total = gpu->batch_count, pending = total;
+
+    if (gpu->ring != NULL) {
+        return ring_publish(gpu);
+    }
+
+    if (gpu->batch_count == 0) {
+        return 1;
+    }
+
+    gpu->batch_count = 0;
+
+    /*
+     * O driver pode aceitar so o inicio do lote (espera interrompida ou fila cheia); o resto
+     * é reenviado com um novo cabeçalho logo antes dos comandos que faltam.
+     */
+    while (pending > 0) {
+        unsigned char *start = gpu->batch_buffer + (size_t) (total - pending) * GPU_COMMAND_SIZE;
+        size_t len = sizeof(header) + (size_t) pending * GPU_COMMAND_SIZE;
+        ssize_t written;
+
+        header.type = GPU_CMD_BATCH;
+        header.flags = 0;
+        header.count = pending;
+        memcpy(start, &header, sizeof(header));
+
+        written = write(gpu->fd, start, len);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written < (ssize_t) sizeof(header)) {
+            perror("Failed to write to the device");
+            return 0;
+        }
+        pending -= (written - sizeof(header)) / GPU_COMMAND_SIZE;
+    }
+
+    return 1;
+}
+
+static int chardev_control(Gpu_Device *gpu, unsigned long request, unsigned long arg) {
+    return ioctl(gpu->fd, request, arg);
+}
+
+static int chardev_sync(Gpu_Device *gpu) {
+    return fsync(gpu->fd);
+}
+
+/**
+ * \brief           Usada pelos transportes sem driver para executar um comando, expandindo macros
+ * \return          Retorna 1 quando o comando foi executado, e 0 quando ocorreu uma falha
+ */
+static int direct_execute(Gpu_Device *gpu, const struct gpu_command *command) {
+    uint32_t i;
+
+    gpu->commands++;
+    if (command->bytes[0] == GPU_CMD_RAW) {
+        struct gpu_instruction instruction = gpu_unpack_raw(command);
+
+        if (!gpu_instruction_valid(instruction)) {
+            fprintf(stderr, "Invalid instruction\n");
+            return 0;
+        }
+        return gpu->backend->write_instruction(gpu, instruction);
+    }
+
+    if (!gpu_is_macro(command) || !gpu_macro_valid(command)) {
+        /* A biblioteca so envia instruções montadas e macros */
+        fprintf(stderr, "Unsupported command %u\n", command->bytes[0]);
+        return 0;
+    }
+    for (i = 0; i < gpu_macro_length(command); i++) {
+        if (!gpu->backend->write_instruction(gpu, gpu_macro_instruction(command, i))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * \brief           Usada pelos transportes sem driver para executar um comando ou acumular no lote
+ */
+static int direct_send(Gpu_Device *gpu, const unsigned char *command, size_t len) {
+    struct gpu_command padded;
+
+    if (gpu->batch_depth > 0) {
+        return batch_append(gpu, command, len);
+    }
+
+    memset(&padded, 0, sizeof(padded));
+    memcpy(padded.bytes, command, len);
+    return direct_execute(gpu, &padded);
+}
+
+/**
+ * \brief           Usada pelos transportes sem driver para executar os comandos acumulados no lote
+ */
+static int direct_flush(Gpu_Device *gpu) {
+    const struct gpu_command *commands = (const struct gpu_command *) (gpu->batch_buffer + sizeof(struct gpu_batch_header));
+    uint16_t count = gpu->batch_count;
+    uint16_t i;
+
+    gpu->batch_count = 0;
+    for (i = 0; i < count; i++) {
+        if (!direct_execute(gpu, &commands[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * \brief           Usada pelos transportes sem driver para atender os comandos GPU_IOC_*
+ *
+ * As instruções sao escritas na GPU antes da função da biblioteca retornar, entao toda
+ * cerca ja foi alcançada, e nao existem filas de prioridade.
+ */
+static int direct_control(Gpu_Device *gpu, unsigned long request, unsigned long arg) {
+    switch (request) {
+        case GPU_IOC_FENCE:
+            memset((void *) arg, 0, sizeof(struct gpu_fence));
+            return 0;
+        case GPU_IOC_STATS: {
+            struct gpu_stats *stats = (struct gpu_stats *) arg;
+
+            stats->commands = gpu->commands;
+            stats->coalesced = 0;
+            return 0;
+        }
+        case GPU_IOC_WAIT_FENCE:
+        case GPU_IOC_SET_LANE:
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+/**
+ * \brief           Usada para mapear a ponte da GPU, sem passar pelo driver
+ *
+ * A ponte pode vir de tres arquivos: /dev/mem, mapeado em GPU_BRIDGE_BASE; um
+ * dispositivo UIO (/dev/uioN) cuja primeira regiao ja é a ponte; ou um arquivo comum,
+ * usado como janela de registradores falsa para testes sem a placa. O arquivo comum
+ * cresce ate GPU_BRIDGE_SPAN e WRFULL fica zerado, a menos que o teste o escreva.
+ *
+ * \param[in]       path: /dev/mem, /dev/uioN ou arquivo comum, NULL para /dev/mem
+ * \return          Retorna 1 quando a ponte foi mapeada, e 0 quando ocorreu uma falha
+ */
+static int mmio_open(Gpu_Device *gpu, const char *path) {
+    struct stat info;
+    off_t offset = 0;
+    void *bridge;
+
+    if (path == NULL) {
+        path = "/dev/mem";
+    }
+    gpu->fd = open(path, O_RDWR | O_SYNC);
+    if (gpu->fd < 0) {
+        perror("Failed to open the device");
+        return 0;
+    }
+
+    if (strcmp(path, "/dev/mem") == 0) {
+        offset = GPU_BRIDGE_BASE;
+    } else if (fstat(gpu->fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size < GPU_BRIDGE_SPAN &&
+               ftruncate(gpu->fd, GPU_BRIDGE_SPAN) < 0) {
+        perror("Failed to size the register file");
+        close(gpu->fd);
+        return 0;
+    }
+
+    bridge = mmap(NULL, GPU_BRIDGE_SPAN, PROT_READ | PROT_WRITE, MAP_SHARED, gpu->fd, offset);
+    if (bridge == MAP_FAILED) {
+        perror("Failed to map the GPU bridge");
+        close(gpu->fd);
+        return 0;
+    }
+    gpu->bridge = bridge;
+    return 1;
+}
+
+static void mmio_close(Gpu_Device *gpu) {
+    munmap(gpu->bridge, GPU_BRIDGE_SPAN);
+    gpu->bridge = NULL;
+    close(gpu->fd);
+}
+
+/**
+ * \brief           Usada para acessar um registrador da ponte mapeada
+ */
+static volatile uint32_t *mmio_register(Gpu_Device *gpu, uint32_t offset) {
+    return (volatile uint32_t *) ((volatile unsigned char *) gpu->bridge + offset);
+}
+
+/**
+ * \brief           Usada para escrever uma instrução nas filas DATA_A e DATA_B, esperando WRFULL cair
+ */
+static int mmio_write_instruction(Gpu_Device *gpu, struct gpu_instruction instruction) {
+    while (*mmio_register(gpu, GPU_REG_WRFULL)) {
+        /* Fila da GPU cheia, as instruções levam alguns microssegundos para serem consumidas */
+    }
+
+    *mmio_register(gpu, GPU_REG_START) = 0;
+    *mmio_register(gpu, GPU_REG_DATA_A) = instruction.data_a;
+    *mmio_register(gpu, GPU_REG_DATA_B) = instruction.data_b;
+    *mmio_register(gpu, GPU_REG_START) = 1;
+    *mmio_register(gpu, GPU_REG_START) = 0;
+    return 1;
+}
+
+/**
+ * \brief           Usada para esperar a fila da GPU esvaziar o suficiente para aceitar instruções
+ */
+static int mmio_sync(Gpu_Device *gpu) {
+    while (*mmio_register(gpu, GPU_REG_WRFULL)) {
+    }
+    return 0;
+}
+
+/**
+ * \brief           Estado do simulador das filas DATA_A/DATA_B da GPU
+ *
+ * A ocupação da fila so é recalculada quando uma instrução é escrita: a GPU consome
+ * uma instrução a cada drain_ns desde a ultima contagem.
+ */
+struct gpu_sim {
+    struct gpu_sim_config config;                    /*!< Tempos e profundidade simulados. */
+    struct gpu_sim_stats stats;                      /*!< Contadores lidos com gpu_sim_get_stats(). */
+    uint32_t level;                                  /*!< Instruções na fila. */
+    uint64_t level_ns;                               /*!< Momento ate o qual o consumo ja foi contado em level. */
+};
+
+/**
+ * \brief           Usada para descontar da fila simulada as instruções ja consumidas pela GPU
+ */
+static void sim_drain(struct gpu_sim *sim, uint64_t now) {
+    uint64_t drained = sim->config.drain_ns ? (now - sim->level_ns) / sim->config.drain_ns : sim->level;
+
+    if (drained >= sim->level) {
+        sim->level = 0;
+        sim->level_ns = now;
+    } else {
+        sim->level -= drained;
+        sim->level_ns += drained * sim->config.drain_ns;
+    }
+}
+
+/**
+ * \brief           Usada para esperar sem ocupar o processador
+ */
+static void sleep_ns(uint64_t ns) {
+    struct timespec delay;
+
+    delay.tv_sec = ns / 1000000000u;
+    delay.tv_nsec = ns % 1000000000u;
+    nanosleep(&delay, NULL);
+}
+
+/**
+ * \brief           Usada para criar o simulador com a configuração padrão, o simulador nao usa arquivo
+ */
+static int sim_open(Gpu_Device *gpu, const char *path) {
+    static const struct gpu_sim_config defaults = GPU_SIM_DEFAULTS;
+
+    (void) path;
+    gpu->sim = calloc(1, sizeof(*gpu->sim));
+    if (gpu->sim == NULL) {
+        perror("Failed to open the device");
+        return 0;
+    }
+    gpu->sim->config = defaults;
+    gpu->sim->level_ns = now_ns();
+    gpu->fd = -1;
+    return 1;
+}
+
+static void sim_close(Gpu_Device *gpu) {
+    free(gpu->sim);
+    gpu->sim = NULL;
+}
+
+/**
+ * \brief           Usada para simular a escrita de uma instrução: custo da escrita e espera por WRFULL
+ */
+static int sim_write_instruction(Gpu_Device *gpu, struct gpu_instruction instruction) {
+    struct gpu_sim *sim = gpu->sim;
+    uint64_t start = now_ns();
+    uint64_t now;
+
+    /* Escritas nos registradores da ponte ocupam o processador */
+    while ((now = now_ns()) - start < sim->config.write_ns) {
+    }
+
+    sim_drain(sim, now);
+    if (sim->level >= sim->config.fifo_depth) {
+        /* WRFULL: le o registrador de novo a cada poll_ns, como o driver */
+        sim->stats.stalls++;
+        do {
+            sleep_ns(sim->config.poll_ns);
+            sim_drain(sim, now_ns());
+        } while (sim->level >= sim->config.fifo_depth);
+        sim->stats.stall_ns += now_ns() - now;
+    }
+
+    if (sim->level == 0) {
+        sim->level_ns = now_ns();
+    }
+    sim->level++;
+    if (sim->level > sim->stats.max_level) {
+        sim->stats.max_level = sim->level;
+    }
+    sim->stats.instructions[instruction.data_a & 0b11]++;
+    if (sim->config.observer != NULL) {
+        sim->config.observer(sim->config.observer_context, instruction);
+    }
+    return 1;
+}
+
+/**
+ * \brief           Usada para esperar a fila simulada esvaziar
+ */
+static int sim_sync(Gpu_Device *gpu) {
+    struct gpu_sim *sim = gpu->sim;
+
+    sim_drain(sim, now_ns());
+    if (sim->level > 0) {
+        sleep_ns((uint64_t) sim->level * sim->config.drain_ns);
+        sim_drain(sim, now_ns());
+    }
+    return 0;
+}
+
+/* Driver gpu_driver por /dev/gpu_driverN, com anel compartilhado quando disponivel */
+const Gpu_Backend gpu_backend_chardev = {
+    .name = "chardev",
+    .open = chardev_open,
+    .close = chardev_close,
+    .send = chardev_send,
+    .flush = chardev_flush,
+    .control = chardev_control,
+    .sync = chardev_sync,
+};
+
+/* Escrita direta nos registradores da ponte por /dev/mem, sem o driver */
+const Gpu_Backend gpu_backend_mmio = {
+    .name = "mmio",
+    .open = mmio_open,
+    .close = mmio_close,
+    .send = direct_send,
+    .flush = direct_flush,
+    .control = direct_control,
+    .sync = mmio_sync,
+    .write_instruction = mmio_write_instruction,
+};
+
+/* Simulador das filas da GPU no proprio processo, sem hardware */
+const Gpu_Backend gpu_backend_sim = {
+    .name = "sim",
+    .open = sim_open,
+    .close = sim_close,
+    .send = direct_send,
+    .flush = direct_flush,
+    .control = direct_control,
+    .sync = sim_sync,
+    .write_instruction = sim_write_instruction,
+};
+
+/**
+ * \brief           Usada para enviar ao transporte os comandos acumulados no lote
+ *
+ * A copia do estado ja recebeu os comandos do lote quando eles foram acumulados, entao
+ * uma falha aqui a descarta, como em send_command(): nao se sabe o que chegou na GPU.
+ *
+ * \return          Retorna 1 quando o lote foi enviado, e 0 quando ocorreu uma falha
+ */
+static int flush_batch() {
+    if (!device->backend->flush(device)) {
+        memset(device->shadow_known, 0, sizeof(device->shadow_known));
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * \brief           Usada para enviar um comando pelo transporte da GPU e grava-lo no rastreamento quando ligado
+ *
+ * \param[in]       command: Comando no formato avulso
+ * \param[in]       len: Tamanho do comando em bytes
+ * \return          Retorna 1 quando o comando foi enviado ou acumulado, e 0 quando ocorreu uma falha
+ */
+static int transmit_command(const unsigned char *command, size_t len) {
+    int result = device->backend->send(device, command, len);
+
+    if (__builtin_expect(trace_entries != NULL, 0)) {
+        trace_record(GPU_TRACE_COMMAND, command, len, result);
+    }
+    if (__builtin_expect(record_file != NULL, 0)) {
+        record(GPU_RECORD_COMMAND, command, len);
+    }
+    return result;
+}
+
+/**
+ * \brief           Usada para normalizar o DATA_B guardado na copia do estado da GPU
+ *
+ * Sprites desativados e poligonos de tamanho 0 nao aparecem na tela, entao todos sao
+ * guardados como 0 e desativar de novo nao gera escrita.
+ */
+static uint32_t shadow_value(struct gpu_instruction instruction) {
+    uint32_t opcode = instruction.data_a & 0b11;
+
+    if (opcode == GPU_OPCODE_WBR && (instruction.data_a >> 4) != 0 && !(instruction.data_b & (1u << 29))) {
+        return 0;
+    }
+    if (opcode == GPU_OPCODE_DP && ((instruction.data_b >> 18) & 0b1111) == 0) {
+        return 0;
+    }
+    return instruction.data_b;
+}
+
+/**
+ * \brief           Usada para saber se a GPU ja tem o valor que a instrução escreveria
+ */
+static int shadow_matches(const Gpu_Device *gpu, struct gpu_instruction instruction) {
+    int target = gpu_target(instruction.data_a, instruction.data_a >> 4);
+
+    return target >= 0 && (gpu->shadow_known[target / 32] & (1u << (target % 32))) &&
+           gpu->shadow[target] == shadow_value(instruction);
+}
+
+/**
+ * \brief           Usada para guardar na copia do estado da GPU o valor escrito pela instrução
+ */
+static void shadow_store(Gpu_Device *gpu, struct gpu_instruction instruction) {
+    int target = gpu_target(instruction.data_a, instruction.data_a >> 4);
+
+    if (target >= 0) {
+        gpu->shadow[target] = shadow_value(instruction);
+        gpu->shadow_known[target / 32] |= 1u << (target % 32);
+    }
+}
+
+/**
+ * \brief           Usada para descartar do comando as escritas que nao mudam a GPU
+ *
+ * Instruções iguais à copia do estado sao descartadas e macros sao reduzidas à faixa
+ * (ou ao retangulo) que contem todas as escritas necessarias. Comandos desconhecidos
+ * invalidam a copia inteira.
+ *
+ * \param[in,out]   command: Comando no formato avulso, reduzido no lugar
+ * \return          Retorna 1 quando o comando ainda deve ser enviado, e 0 quando nao muda a GPU
+ */
+static int shadow_filter(Gpu_Device *gpu, struct gpu_command *command) {
+    uint32_t length, i, first = UINT32_MAX, last = 0;
+    uint8_t *bytes = command->bytes;
+
+    if (bytes[0] == GPU_CMD_RAW) {
+        struct gpu_instruction instruction = gpu_unpack_raw(command);
+
+        if (shadow_matches(gpu, instruction)) {
+            gpu->elided++;
+            return 0;
+        }
+        shadow_store(gpu, instruction);
+        return 1;
+    }
+    if (!gpu_is_macro(command) || !gpu_macro_valid(command)) {
+        memset(gpu->shadow_known, 0, sizeof(gpu->shadow_known));
+        return 1;
+    }
+
+    length = gpu_macro_length(command);
+    if (bytes[0] == GPU_CMD_FILL_BLOCKS) {
+        uint8_t column = 80, line = 60, right = 0, bottom = 0;
+
+        for (i = 0; i < length; i++) {
+            if (!shadow_matches(gpu, gpu_macro_instruction(command, i))) {
+                column = i % bytes[3] < column ? i % bytes[3] : column;
+                right = i % bytes[3] + 1 > right ? i % bytes[3] + 1 : right;
+                line = i / bytes[3] < line ? i / bytes[3] : line;
+                bottom = i / bytes[3] + 1;
+            }
+        }
+        if (right == 0) {
+            gpu->elided += length;
+            return 0;
+        }
+        gpu->elided += length - (uint32_t) (right - column) * (bottom - line);
+        bytes[1] += column;
+        bytes[2] += line;
+        bytes[3] = right - column;
+        bytes[4] = bottom - line;
+    } else {
+        for (i = 0; i < length; i++) {
+            if (!shadow_matches(gpu, gpu_macro_instruction(command, i))) {
+                first = first == UINT32_MAX ? i : first;
+                last = i;
+            }
+        }
+        if (first == UINT32_MAX) {
+            gpu->elided += length;
+            return 0;
+        }
+        gpu->elided += length - (last - first + 1);
+        bytes[1] += first;
+        bytes[2] = last - first + 1;
+    }
+
+    for (i = 0; i < gpu_macro_length(command); i++) {
+        shadow_store(gpu, gpu_macro_instruction(command, i));
+    }
+    return 1;
+}
+
+/**
+ * \brief           Usada para ler o boot_id do sistema, vazio quando nao disponivel
+ */
+static void atlas_boot_id(char boot_id[40]) {
+    FILE *file = fopen("/proc/sys/kernel/random/boot_id", "r");
+
+    memset(boot_id, 0, 40);
+    if (file != NULL) {
+        if (fgets(boot_id, 40, file) == NULL) {
+            boot_id[0] = '\0';
+        }
+        fclose(file);
+    }
+}
+
+/**
+ * \brief           Usada para gravar os hashes dos slots residentes no arquivo de estado do atlas
+ * \return          Retorna 0 quando a operação não foi realizada, e 1 quando foi bem sucedida
+ */
+static int atlas_save(const Gpu_Device *gpu) {
+    struct atlas_state state = { .magic = ATLAS_STATE_MAGIC, .resident = gpu->atlas_resident };
+    FILE *file;
+
+    atlas_boot_id(state.boot_id);
+    memcpy(state.hashes, gpu->atlas_hashes, sizeof(state.hashes));
+
+    file = fopen(gpu->atlas_state, "wb");
+    if (file == NULL) {
+        perror("Failed to open the atlas state");
+        return 0;
+    }
+    fwrite(&state, sizeof(state), 1, file);
+    if (fclose(file) != 0) {
+        perror("Failed to write the atlas state");
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * \brief           Usada para tirar do estado do atlas o slot que uma escrita na memoria de sprites alterou
+ *
+ * Assim a proxima execução carrega o slot de novo, mesmo que o processo termine sem avisar.
+ */
+static void atlas_overwritten(Gpu_Device *gpu, struct gpu_instruction instruction) {
+    uint32_t slot = (instruction.data_a >> 4) / GPU_SPRITE_PIXELS;
+
+    if ((instruction.data_a & 0b11) == GPU_OPCODE_WSM && (gpu->atlas_resident & (1u << slot))) {
+        gpu->atlas_resident &= ~(1u << slot);
+        atlas_save(gpu);
+    }
+}
+
+/**
+ * \brief           Usada para tirar da copia do estado os alvos escritos pela thread de assets
+ */
+static void asset_apply_dirty(Gpu_Device *gpu) {
+    size_t i;
+
+    if (__atomic_load_n(&asset_generation, __ATOMIC_ACQUIRE) == gpu->asset_generation) {
+        return;
+    }
+    pthread_mutex_lock(&asset_lock);
+    for (i = 0; i < sizeof(asset_dirty) / sizeof(asset_dirty[0]); i++) {
+        gpu->shadow_known[i] &= ~asset_dirty[i];
+        asset_dirty[i] = 0;
+    }
+    gpu->asset_generation = asset_generation;
+    pthread_mutex_unlock(&asset_lock);
+}
+
+/**
+ * \brief           Usada para enviar um comando que muda a GPU, descartando as escritas redundantes
+ *
+ * \param[in]       command: Comando no formato avulso
+ * \param[in]       len: Tamanho do comando em bytes
+ * \return          Retorna 1 quando o comando foi enviado, acumulado ou descartado, e 0 quando ocorreu uma falha
+ */
+static int send_command(const unsigned char *command, size_t len) {
+    struct gpu_command filtered = { 0 };
+
+    memcpy(filtered.bytes, command, len);
+    if (__builtin_expect(device == asset_owner, 0)) {
+        asset_apply_dirty(device);
+    }
+    if (!shadow_filter(device, &filtered)) {
+        return 1;
+    }
+    if (__builtin_expect(device->atlas_resident != 0, 0) && filtered.bytes[0] == GPU_CMD_RAW) {
+        atlas_overwritten(device, gpu_unpack_raw(&filtered));
+    }
+    if (!transmit_command(filtered.bytes, len)) {
+        /* Nao se sabe o que chegou na GPU */
+        memset(device->shadow_known, 0, sizeof(device->shadow_known));
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * \brief           Usada para enviar um comando ja no formato dos lotes, como os lidos de uma gravação
+ *
+ * \param[in]       command: Comando no formato avulso
+ * \param[in]       length: Tamanho do comando em bytes, no maximo GPU_COMMAND_SIZE
+ * \return          Retorna 1 quando o comando foi enviado ou acumulado, e 0 quando ocorreu uma falha
+ */
+int gpu_send_command(const struct gpu_command *command, uint16_t length) {
+    if (length == 0 || length > GPU_COMMAND_SIZE) {
+        fprintf(stderr, "Invalid command length %u\n", length);
+        return 0;
+    }
+    return send_command(command->bytes, length);
+}
+
+/**
+ * \brief           Usada para enviar uma instrução ja montada (comando GPU_CMD_RAW), sem decodificação no driver
+ *
+ * \param[in]       instruction: Instrução montada por uma das funções gpu_encode_*
+ * \return          Retorna 1 quando o comando foi enviado ou acumulado, e 0 quando ocorreu uma falha
+ */
+static int send_instruction(struct gpu_instruction instruction) {
+    struct gpu_command command;
+
+    gpu_pack_raw(&command, instruction);
+    return send_command(command.bytes, sizeof(command.bytes));
+}
+
+/**
+ * \brief           Usada para abrir um lote, os comandos seguintes sao acumulados em memoria ate gpu_submit_batch()
+ *
+ * Lotes podem ser aninhados, os comandos so sao enviados quando o lote mais externo for submetido.
+ */
+void gpu_begin_batch() {
+    if (__builtin_expect(record_file != NULL, 0) && device->batch_depth == 0) {
+        record(GPU_RECORD_BEGIN, NULL, 0);
+    }
+    device->batch_depth++;
+}
+
+/**
+ * \brief           Usada para fechar o lote aberto por gpu_begin_batch() e enviar os comandos acumulados em um unico write()
+ * \return          Retorna 0 quando o envio falhou, e 1 quando foi bem sucedido
+ */
+int gpu_submit_batch() {
+    if (device->batch_depth == 0) {
+        return 1;
+    }
+
+    device->batch_depth--;
+    if (device->batch_depth > 0) {
+        return 1;
+    }
+
+    if (__builtin_expect(record_file != NULL, 0)) {
+        record(GPU_RECORD_SUBMIT, NULL, 0);
+    }
+    return flush_batch();
+}
+
+/**
+ * \brief           Usada para obter uma cerca com todos os comandos enviados ate agora
+ *
+ * Os comandos sao enviados para a GPU em segundo plano pelo driver, a cerca permite
+ * esperar depois (gpu_wait_fence()) apenas pelos comandos anteriores a ela.
+ *
+ * \param[out]      fence: Cerca preenchida pelo driver
+ * \return          Retorna 0 quando a operação não foi realizada, e 1 quando foi bem sucedida
+ */
+int gpu_get_fence(struct gpu_fence *fence) {
+    /* Comandos ainda acumulados no lote tambem fazem parte da cerca */
+    if (!flush_batch()) {
+        return 0;
+    }
+
+    if (device->backend->control(device, GPU_IOC_FENCE, (unsigned long) fence) < 0) {
+        perror("Failed to get a fence from the device");
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * \brief           Usada para esperar todos os comandos anteriores a uma cerca chegarem na GPU
+ *
+ * \param[in]       fence: Cerca obtida com gpu_get_fence()
+ * \return          Retorna 0 quando a operação não foi realizada, e 1 quando foi bem sucedida
+ */
+int gpu_wait_fence(const struct gpu_fence *fence) {
+    if (device->backend->control(device, GPU_IOC_WAIT_FENCE, (unsigned long) fence) < 0) {
+        perror("Failed to wait for a fence");
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * \brief           Usada para escolher a fila de prioridade do driver usada pelos proximos comandos
+ *
+ * Por padrao (GPU_LANE_AUTO) o driver coloca sprites, cor do background e poligonos na
+ * fila de latencia e blocos do background e pixels de sprites na fila de volume.
+ * Comandos do anel que o driver ainda nao consumiu tambem passam a usar a nova fila.
+ *
+ * \param[in]       lane: GPU_LANE_AUTO, GPU_LANE_LATENCY ou GPU_LANE_BULK
+ * \return          Retorna 0 quando a operação não foi realizada, e 1 quando foi bem sucedida
+ */
+int gpu_set_lane(int lane) {
+    /* Comandos acumulados no lote ainda sao da fila anterior */
+    if (!flush_batch()) {
+        return 0;
+    }
+
+    if (device->backend->control(device, GPU_IOC_SET_LANE, (unsigned long) (long) lane) < 0) {
+        perror("Failed to set the command lane");
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * \brief           Usada para ler os contadores do driver para este processo
+ *
+ * \param[out]      stats: Comandos consumidos e descartados pelo agrupamento de escritas
+ * \return          Retorna 0 quando a operação não foi realizada, e 1 quando foi bem sucedida
+ */
+int gpu_get_stats(struct gpu_stats *stats) {
+    if (device->backend->control(device, GPU_IOC_STATS, (unsigned long) stats) < 0) {
+        perror("Failed to read the device stats");
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * \brief           Usada para esperar todos os comandos ja enviados chegarem na GPU
+ * \return          Retorna 0 quando a operação não foi realizada, e 1 quando foi bem sucedida
+ */
+int gpu_sync() {
+    if (!flush_batch()) {
+        return 0;
+    }
+
+    if (device->backend->sync(device) < 0) {
+        perror("Failed to sync the device");
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * \brief           Usada para reenviar para a GPU todo o estado conhecido pela biblioteca
+ *
+ * A biblioteca guarda o ultimo valor escrito em cada registrador e memoria da GPU e
+ * nao envia escritas que nao mudam nada. Se a GPU foi alterada por fora (outro
+ * processo, reset da placa), gpu_resync() reescreve todos os valores conhecidos, e
+ * clear = 1 esquece a copia antes, entao as proximas escritas sao todas enviadas.
+ *
+ * \param[in]       clear: 1 para apenas esquecer o estado, 0 para reenvia-lo
+ * \return          Retorna 0 quando o envio falhou, e 1 quando foi bem sucedido
+ */
+int gpu_resync(int clear) {
+    /* Primeiro alvo de cada memoria, indexado pelo OPCODE como em gpu_target() */
+    static const int first[5] = {
+        0,
+        GPU_SPRITE_REGISTERS,
+        GPU_SPRITE_REGISTERS + GPU_SPRITE_MEMORY_SIZE,
+        GPU_SPRITE_REGISTERS + GPU_SPRITE_MEMORY_SIZE + GPU_BACKGROUND_BLOCKS,
+        GPU_TARGETS,
+    };
+    struct gpu_instruction instruction;
+    struct gpu_command command;
+    uint32_t opcode;
+    int target, result = 1;
+
+    if (clear) {
+        memset(device->shadow_known, 0, sizeof(device->shadow_known));
+        return 1;
+    }
+
+    gpu_begin_batch();
+    for (opcode = 0; opcode < 4; opcode++) {
+        for (target = first[opcode]; target < first[opcode + 1] && result; target++) {
+            if (!(device->shadow_known[target / 32] & (1u << (target % 32)))) {
+                continue;
+            }
+            instruction.data_a = ((uint32_t) (target - first[opcode]) << 4) | opcode;
+            instruction.data_b = device->shadow[target];
+            gpu_pack_raw(&command, instruction);
+            result = transmit_command(command.bytes, sizeof(command.bytes));
+        }
+    }
+    return gpu_submit_batch() && result;
+}
+
+/**
+ * \brief           Usada para saber quantas instruções foram descartadas por nao mudarem a GPU selecionada
+ */
+uint64_t gpu_elided_writes() {
+    return device->elided;
+}
+
+/**
+ * \brief           Usada para ligar o rastreamento dos comandos enviados por todas as threads
+ *
+ * Os registros mais antigos sao sobrescritos quando o anel enche. Chamar de novo
+ * descarta o rastreamento anterior.
+ *
+ * \param[in]       entries: Quantidade de registros guardados, deve ser potencia de 2
+ * \return          Retorna 0 quando a operação não foi realizada, e 1 quando foi bem sucedida
+ */
+int gpu_trace_start(uint32_t entries) {
+    struct gpu_trace_entry *buffer;
+
+    if (entries == 0 || (entries & (entries - 1)) != 0) {
+        fprintf(stderr, "Trace size must be a power of 2\n");
+        return 0;
+    }
+
+    buffer = calloc(entries, sizeof(*buffer));
+    if (buffer == NULL) {
+        perror("Failed to allocate the trace");
+        return 0;
+    }
+
+    gpu_trace_stop();
+    trace_mask = entries - 1;
+    __atomic_store_n(&trace_next, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&trace_entries, buffer, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/**
+ * \brief           Usada para desligar o rastreamento e liberar os registros
+ *
+ * Nao deve ser chamada enquanto outra thread envia comandos.
+ */
+void gpu_trace_stop() {
+    struct gpu_trace_entry *buffer = __atomic_exchange_n(&trace_entries, NULL, __ATOMIC_ACQ_REL);
+
+    free(buffer);
+}
+
+/**
+ * \brief           Usada para marcar o inicio de um quadro no rastreamento e na gravação, sem efeito com eles desligados
+ */
+void gpu_trace_frame() {
+    if (__builtin_expect(trace_entries != NULL, 0)) {
+        trace_record(GPU_TRACE_FRAME, NULL, 0, 1);
+    }
+    if (__builtin_expect(record_file != NULL, 0)) {
+        record(GPU_RECORD_FRAME, NULL, 0);
+    }
+}
+
+/**
+ * \brief           Usada para gravar os registros do rastreamento em um arquivo, do mais antigo para o mais recente
+ *
+ * O arquivo é lido com o programa trace_dump. Registros sendo escritos por outra thread
+ * durante a gravação sao ignorados.
+ *
+ * \param[in]       path: Caminho do arquivo criado
+ * \return          Retorna 0 quando a operação não foi realizada, e 1 quando foi bem sucedida
+ */
+int gpu_trace_dump(const char *path) {
+    struct gpu_trace_entry *entries = __atomic_load_n(&trace_entries, __ATOMIC_ACQUIRE);
+    struct gpu_trace_file header;
+    uint64_t next, first, sequence;
+    FILE *file;
+
+    if (entries == NULL) {
+        fprintf(stderr, "Trace is not enabled\n");
+        return 0;
+    }
+
+    file = fopen(path, "wb");
+    if (file == NULL) {
+        perror("Failed to open the trace file");
+        return 0;
+    }
+
+    next = __atomic_load_n(&trace_next, __ATOMIC_ACQUIRE);
+    first = next > trace_mask + 1 ? next - (trace_mask + 1) : 0;
+
+    header.magic = GPU_TRACE_MAGIC;
+    header.count = 0;
+    header.lost = first;
+    fwrite(&header, sizeof(header), 1, file);
+
+    for (sequence = first; sequence < next; sequence++) {
+        struct gpu_trace_entry entry = entries[sequence & trace_mask];
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (entry.sequence != sequence + 1 ||
+            __atomic_load_n(&entries[sequence & trace_mask].sequence, __ATOMIC_RELAXED) != sequence + 1) {
+            continue;
+        }
+        fwrite(&entry, sizeof(entry), 1, file);
+        header.count++;
+    }
+
+    /* Reescreve o cabeçalho com a quantidade de registros gravados */
+    rewind(file);
+    fwrite(&header, sizeof(header), 1, file);
+    if (fclose(file) != 0) {
+        perror("Failed to write the trace file");
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * \brief           Usada para ligar a gravação de todos os comandos enviados, por todas as threads, em um arquivo
+ *
+ * Diferente do rastreamento nada é descartado: cada comando, lote e quadro é escrito
+ * no arquivo com o tempo desde o registro anterior, para ser reenviado depois pelo
+ * programa gpu_replay. Chamar de novo fecha a gravação anterior.
+ *
+ * \param[in]       path: Caminho do arquivo criado
+ * \return          Retorna 0 quando a operação não foi realizada, e 1 quando foi bem sucedida
+ */
+int gpu_record_start(const char *path) {
+    struct gpu_record_file header = { .magic = GPU_RECORD_MAGIC };
+    FILE *file;
+
+    file = fopen(path, "wb");
+    if (file == NULL) {
+        perror("Failed to open the record file");
+        return 0;
+    }
+    if (fwrite(&header, sizeof(header), 1, file) != 1) {
+        perror("Failed to write the record file");
+        fclose(file);
+        return 0;
+    }
+
+    gpu_record_stop();
+    pthread_mutex_lock(&record_lock);
+    record_last_ns = now_ns();
+    __atomic_store_n(&record_file, file, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&record_lock);
+    return 1;
+}
+
+/**
+ * \brief           Usada para desligar a gravação e fechar o arquivo
+ * \return          Retorna 0 quando o arquivo nao pode ser gravado, e 1 quando foi bem sucedida
+ */
+int gpu_record_stop() {
+    FILE *file;
+
+    pthread_mutex_lock(&record_lock);
+    file = record_file;
+    __atomic_store_n(&record_file, NULL, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&record_lock);
+
+    if (file != NULL && fclose(file) != 0) {
+        perror("Failed to write the record file");
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * \brief           Usada para abrir uma GPU pelo transporte escolhido
+ *
+ * \param[out]      gpu: Estado da GPU, zerado antes de abrir
+ * \param[in]       backend: Transporte usado
+ * \param[in]       path: Caminho passado ao transporte
+ * \return          Retorna 1 caso a GPU foi aberta ou retorna 0 caso não seja possivel abrir
+ */
+static int open_device(Gpu_Device *gpu, const Gpu_Backend *backend, const char *path) {
+    memset(gpu, 0, sizeof(*gpu));
+    gpu->backend = backend;
+    if (!backend->open(gpu, path)) {
+        gpu->fd = -1;
+        return 0;
+    }
+    gpu->path = path != NULL ? strdup(path) : NULL;
+    return 1;
+}
+
+/**
+ * \brief           Usada para fechar uma GPU aberta por open_device()
+ */
+static void close_device(Gpu_Device *gpu) {
+    if (gpu == asset_owner) {
+        gpu_assets_stop();
+    }
+    gpu->backend->close(gpu);
+    free(gpu->path);
+    gpu->path = NULL;
+    if (gpu->bitmaps != NULL) {
+        free(gpu->bitmaps->entries);
+        free(gpu->bitmaps);
+        gpu->bitmaps = NULL;
+    }
+    gpu->fd = -1;
+    free(gpu->atlas_state);
+    gpu->atlas_state = NULL;
+    gpu->atlas_resident = 0;
+}
+
+/**
+ * \brief           Usada para encontrar um transporte pelo nome
+ *
+ * \param[in]       name: "chardev", "mmio" ou "sim"
+ * \return          Retorna o transporte, ou NULL quando o nome é desconhecido
+ */
+const Gpu_Backend *gpu_find_backend(const char *name) {
+    static const Gpu_Backend *const backends[] = { &gpu_backend_chardev, &gpu_backend_mmio, &gpu_backend_sim };
+    size_t i;
+
+    for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+        if (strcmp(backends[i]->name, name) == 0) {
+            return backends[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * \brief           Usada para abrir o arquivo do driver da GPU
+ *
+ * O transporte pode ser trocado sem recompilar pelas variaveis de ambiente GPU_BACKEND
+ * (chardev, mmio ou sim) e GPU_DEVICE (caminho passado ao transporte). Por padrao usa o
+ * driver em DEVICE_PATH.
+ *
+ *  \return         Retorna 1 caso o arquivo foi aberto ou retorna 0 caso não seja possivel abrir o arquivo
+ */
+int open_gpu_device () {
+    const char *name = getenv("GPU_BACKEND");
+    const char *path = getenv("GPU_DEVICE");
+    const Gpu_Backend *backend = &gpu_backend_chardev;
+    int opened;
+
+    if (name != NULL && (backend = gpu_find_backend(name)) == NULL) {
+        fprintf(stderr, "Unknown GPU backend %s\n", name);
+        return 0;
+    }
+    if (path == NULL && backend == &gpu_backend_chardev) {
+        path = DEVICE_PATH;
+    }
+
+    opened = open_device(&default_device, backend, path);
+    fd = default_device.fd;
+    return opened;
+}
+
+/**
+ * \brief           Usada para fechar o arquivo do driver da GPU
+ */
+void close_gpu_devide () {
+    close_device(&default_device);
+    fd = default_device.fd;
+}
+
+/**
+ * \brief           Usada para abrir uma GPU especifica, por exemplo /dev/gpu_driver1
+ *
+ * A GPU aberta so recebe os comandos das funções da biblioteca depois de gpu_use_device().
+ *
+ * \param[in]       path: Caminho do arquivo do driver da GPU
+ * \return          Retorna a GPU aberta, ou NULL caso não seja possivel abrir o arquivo
+ */
+Gpu_Device *open_gpu_device_at(const char *path) {
+    return open_gpu_device_with(&gpu_backend_chardev, path);
+}
+
+/**
+ * \brief           Usada para abrir uma GPU por um transporte especifico
+ *
+ * \param[in]       backend: gpu_backend_chardev, gpu_backend_mmio ou gpu_backend_sim
+ * \param[in]       path: Arquivo do driver (chardev), da ponte (mmio: /dev/mem, /dev/uioN ou arquivo comum, NULL para /dev/mem), ignorado no simulador
+ * \return          Retorna a GPU aberta, ou NULL caso não seja possivel abrir
+ */
+Gpu_Device *open_gpu_device_with(const Gpu_Backend *backend, const char *path) {
+    Gpu_Device *gpu = malloc(sizeof(*gpu));
+
+    if (gpu == NULL) {
+        perror("Failed to open the device");
+        return NULL;
+    }
+    if (!open_device(gpu, backend, path)) {
+        free(gpu);
+        return NULL;
+    }
+    return gpu;
+}
+
+/**
+ * \brief           Usada para abrir uma GPU simulada no proprio processo
+ *
+ * \param[in]       config: Profundidade e tempos da fila simulada, NULL para GPU_SIM_DEFAULTS
+ * \return          Retorna a GPU aberta, ou NULL caso não seja possivel abrir
+ */
+Gpu_Device *open_gpu_simulator(const struct gpu_sim_config *config) {
+    Gpu_Device *gpu = open_gpu_device_with(&gpu_backend_sim, NULL);
+
+    if (gpu != NULL && config != NULL) {
+        gpu->sim->config = *config;
+    }
+    return gpu;
+}
+
+/**
+ * \brief           Usada para ler os contadores do simulador selecionado nesta thread
+ *
+ * \param[out]      stats: Instruções, esperas por WRFULL e ocupação maxima da fila simulada
+ * \return          Retorna 0 quando a GPU nao é simulada, e 1 quando foi bem sucedida
+ */
+int gpu_sim_get_stats(struct gpu_sim_stats *stats) {
+    if (device->sim == NULL) {
+        return 0;
+    }
+    *stats = device->sim->stats;
+    return 1;
+}
+
+/**
+ * \brief           Usada para fechar uma GPU aberta com open_gpu_device_at()
+ *
+ * Comandos ainda acumulados em um lote aberto sao enviados antes de fechar. Caso a
+ * GPU esteja selecionada nesta thread a GPU padrao volta a ser usada.
+ *
+ * \param[in]       gpu: GPU retornada por open_gpu_device_at()
+ */
+void close_gpu_device_at(Gpu_Device *gpu) {
+    Gpu_Device *previous = gpu_use_device(gpu);
+
+    if (device->batch_depth > 0) {
+        device->batch_depth = 0;
+        flush_batch();
+    }
+    gpu_use_device(previous == gpu ? NULL : previous);
+
+    close_device(gpu);
+    free(gpu);
+}
+
+/**
+ * \brief           Usada para escolher a GPU que recebe os comandos das funções da biblioteca nesta thread
+ *
+ * Cada thread tem sua propria escolha, entao threads diferentes podem controlar GPUs
+ * diferentes em paralelo. Lotes abertos continuam pendentes na GPU em que foram abertos.
+ *
+ * \param[in]       gpu: GPU retornada por open_gpu_device_at(), ou NULL para a GPU de open_gpu_device()
+ * \return          Retorna a GPU escolhida antes, NULL quando era a GPU de open_gpu_device()
+ */
+Gpu_Device *gpu_use_device(Gpu_Device *gpu) {
+    Gpu_Device *previous = (device == &default_device) ? NULL : device;
+
+    device = (gpu != NULL) ? gpu : &default_device;
+    return previous;
+}
+
+/**
+ * \brief           Usada para configurar a cor base do background a partir dos valores de Red, Green e Blue.
+ * 
+ * \param[in]       R: Valor para a cor vermelha.
+ * \param[in]       G: Valor para a cor verde.
+ * \param[in]       B: Valor para a cor azul.
+ * \return          Retorna 0 quando a operação não foi realizada, e 1 quando foi bem sucedida
+*/
+int set_background_color (uint8_t R, uint8_t B, uint8_t G) {
+    /* Mantem a mesma posição dos bits que o comando GPU_CMD_BACKGROUND_COLOR gerava no driver */
+    return send_instruction(gpu_encode_background_color(B, G, R));
+}
+
+/**
+ * \brief           Usada para setar um sprite na tela
+ * 
+ * \param[in]       reg: Registrador ao qual o sprite será armazenado
+ * \param[in]       x: Coordenada x do sprite na tela
+ * \param[in]       y: Coordenada y do sprite na tela
+ * \param[in]       offset: Deslocamento na memória para selecionar o bitmap
+ * \param[in]       sp: Ativação do sprite (0 - desativado, 1 - ativado)
+ * \return          Retorna 0 quando a operação não foi realizada, e 1 quando foi bem sucedida
+*/
+int set_sprite(uint8_t reg, uint16_t x, uint16_t y, uint8_t offset, uint8_t sp){
+    return send_instruction(gpu_encode_sprite(reg, x, y, offset, sp));
+}
+
+/**
+ * \brief           Usada para setar um poligono na tela
+ * 
+ * \param[in]       address: Endereço onde o poligono estará armazenado
+ * \param[in]       ref_x: Coordenada x na tela referente ao centro do poligono        
+ * \param[in]       ref_y: Coordenada y na tela referente ao centro do poligono                      
+ * \param[in]       size: Tamanho do poligono        
+ * \param[in]       r: Valor para a cor vermelha 
+ * \param[in]       g: Valor para a cor verde 
+ * \param[in]       b: Valor para a cor azul    
+ * \param[in]       shape: Formato do poligono (0 = quadrado, 1 = triangulo)
+ * \return          Retorna 0 quando a operação não foi realizada, e 1 quando foi bem sucedida
+*/
+int set_poligono(uint16_t address, uint16_t ref_x, uint16_t ref_y, uint8_t size, uint8_t r, uint8_t g, uint8_t b, uint8_t shape){
+    return send_instruction(gpu_encode_polygon(address, ref_x, ref_y, size, r, g, b, shape));
+}
+
+/**
+ * \brief Usada para modelar o background atraves do preenchimento dos blocos de 8x8 pixels
+ * 
+ * \param[in]       column: Valor da coluna do bloco.
+ * \param[in]       line: Valor da linha do bloco.
+ * \param[in]       R: Valor para a cor vermelha.
+ * \param[in]       G: Valor para a cor verde.
+ * \param[in]       B: Valor para a cor azul.
+ * \return          Retorna 0 quando a operação não foi realizada, e 1 quando foi bem sucedida
+*/
+int set_background_block(uint8_t column, uint8_t line, uint8_t R, uint8_t G, uint8_t B){
+    int address = column + (line*80);
+
+    return send_instruction(gpu_encode_background_block(address, R, G, B));
+}
+
+/**
+ * \brief           Usada para mudar o valor RGB de um determinado pixel de um sprite com base no endereço de memoria.
+ * 
+ * \param[in]       address: Endereço de memoria do local que deve ter o valor alterado.
+ * \param[in]       R: Valor para a cor vermelha.
+ * \param[in]       G: Valor para a cor verde.
+ * \param[in]       B: Valor para a cor azul.
+ * \return          Retorna 1 quando colisão foi detectada e 0 quando não.
+*/
+int set_sprite_pixel_color( uint16_t address, uint8_t R, uint8_t G, uint8_t B){
+    return send_instruction(gpu_encode_sprite_pixel(address, R, G, B));
+}
+
+/**
+ * \brief           Usada para escrever um bitmap inteiro de 20x20 pixels na memoria de sprites em um unico envio
+ *
+ * Pixels que a GPU ja tem com a mesma cor nao sao enviados, entao trocar a aparencia de
+ * um sprite ja carregado custa so os pixels diferentes.
+ *
+ * \param[in]       slot: Bitmap escrito, de 0 ate GPU_SPRITE_SLOTS - 1 (o offset usado em set_sprite())
+ * \param[in]       pixels: Cores de 9 bits (GPU_COLOR()) linha por linha, GPU_COLOR_TRANSPARENT nao é desenhado
+ * \return          Retorna 0 quando a operação não foi realizada, e 1 quando foi bem sucedida
+ */
+int upload_sprite_bitmap(uint8_t slot, const uint16_t pixels[GPU_SPRITE_PIXELS]) {
+    uint32_t address = (uint32_t) slot * GPU_SPRITE_PIXELS;
+    int result = 1;
+    int i;
+
+    if (slot >= GPU_SPRITE_SLOTS) {
+        fprintf(stderr, "Invalid sprite slot %u\n", slot);
+        return 0;
+    }
+
+    gpu_begin_batch();
+    for (i = 0; i < GPU_SPRITE_PIXELS && result; i++) {
+        uint16_t color = pixels[i];
+
+        /* Pixels iguais ao da copia do estado sao descartados por send_command() */
+        result = send_instruction(
+            gpu_encode_sprite_pixel(address + i, color & 0b111, (color >> 3) & 0b111, (color >> 6) & 0b111));
+    }
+    return gpu_submit_batch() && result;
+}
+
+/**
+ * \brief           Usada para obter a tabela de bitmaps logicos da GPU selecionada, criando-a no primeiro uso
+ * \return          Retorna a tabela, ou NULL quando ocorreu uma falha
+ */
+static struct bitmap_cache *bitmap_cache() {
+    int slot;
+
+    if (device->bitmaps == NULL) {
+        device->bitmaps = calloc(1, sizeof(*device->bitmaps));
+        if (device->bitmaps == NULL) {
+            perror("Failed to allocate the bitmap table");
+            return NULL;
+        }
+        for (slot = 0; slot < GPU_SPRITE_SLOTS; slot++) {
+            device->bitmaps->owner[slot] = -1;
+        }
+    }
+    return device->bitmaps;
+}
+
+/**
+ * \brief           Usada para escolher os slots da memoria de sprites que os bitmaps logicos podem ocupar
+ *
+ * Os outros slots nunca sao escritos, ficam para os bitmaps usados diretamente com
+ * set_sprite(). Bitmaps em slots que deixam de ser reservados voltam a ficar fora da GPU.
+ *
+ * \param[in]       slots: Mascara dos slots (bit N = slot N)
+ * \return          Retorna 0 quando a operação não foi realizada, e 1 quando foi bem sucedida
+ */
+int gpu_bitmap_reserve(uint32_t slots) {
+    struct bitmap_cache *cache = bitmap_cache();
+    int slot;
+
+    if (cache == NULL) {
+        return 0;
+    }
+    for (slot = 0; slot < GPU_SPRITE_SLOTS; slot++) {
+        if (!(slots & (1u << slot)) && cache->owner[slot] >= 0) {
+            cache->entries[cache->owner[slot]].slot = -1;
+            cache->owner[slot] = -1;
+        }
+    }
+    cache->reserved = slots;
+    return 1;
+}
+
+/**
+ * \brief           Usada para criar um bitmap logico, enviado para a GPU so quando um sprite o usar
+ *
+ * \param[in]       pixels: Cores de 9 bits (GPU_COLOR()) linha por linha, copiadas antes de retornar
+ * \return          Retorna o numero do bitmap, ou -1 quando ocorreu uma falha
+ */
+int gpu_bitmap_create(const uint16_t pixels[GPU_SPRITE_PIXELS]) {
+    struct bitmap_cache *cache = bitmap_cache();
+    struct logical_bitmap *entry;
+    uint32_t bitmap;
+
+    if (cache == NULL) {
+        return -1;
+    }
+    for (bitmap = 0; bitmap < cache->count && cache->entries[bitmap].alive; bitmap++) {
+    }
+    if (bitmap == cache->capacity) {
+        uint32_t capacity = cache->capacity ? cache->capacity * 2 : 32;
+        struct logical_bitmap *entries = realloc(cache->entries, capacity * sizeof(*entries));
+
+        if (entries == NULL) {
+            perror("Failed to allocate the bitmap");
+            return -1;
+        }
+        cache->entries = entries;
+        cache->capacity = capacity;
+    }
+    cache->count = bitmap == cache->count ? cache->count + 1 : cache->count;
+
+    entry = &cache->entries[bitmap];
+    memcpy(entry->pixels, pixels, sizeof(entry->pixels));
+    entry->slot = -1;
+    entry->alive = 1;
+    entry->pinned = 0;
+    entry->last_use = 0;
+    return bitmap;
+}
+
+/**
+ * \brief           Usada para apagar um bitmap logico, liberando o seu slot
+ *
+ * Sprites que ainda mostram o bitmap continuam iguais ate o slot ser reaproveitado.
+ */
+void gpu_bitmap_destroy(int bitmap) {
+    struct bitmap_cache *cache = device->bitmaps;
+
+    if (cache == NULL || bitmap < 0 || (uint32_t) bitmap >= cache->count || !cache->entries[bitmap].alive) {
+        return;
+    }
+    if (cache->entries[bitmap].slot >= 0) {
+        cache->owner[cache->entries[bitmap].slot] = -1;
+    }
+    cache->entries[bitmap].alive = 0;
+}
+
+/**
+ * \brief           Usada para saber em qual slot da memoria de sprites um bitmap logico esta
+ * \return          Retorna o slot, ou -1 quando o bitmap nao esta na GPU
+ */
+int gpu_bitmap_slot(int bitmap) {
+    struct bitmap_cache *cache = device->bitmaps;
+
+    if (cache == NULL || bitmap < 0 || (uint32_t) bitmap >= cache->count || !cache->entries[bitmap].alive) {
+        return -1;
+    }
+    return cache->entries[bitmap].slot;
+}
+
+/**
+ * \brief           Usada para colocar um bitmap logico em um slot, substituindo o bitmap usado ha mais tempo
+ *
+ * A quantidade de registradores de sprite ativos que mostram cada slot vem da copia do
+ * estado da GPU. Slots com algum sprite ativo nao sao substituidos, os outros sao
+ * escolhidos primeiro livres e depois pelo uso mais antigo. Só quando nenhum estiver
+ * disponivel o slot mostrado apenas por reg é reaproveitado. O envio so escreve os pixels
+ * diferentes do bitmap anterior (upload_sprite_bitmap()).
+ *
+ * \return          Retorna o slot, ou -1 quando todos os slots reservados estao em uso
+ */
+static int bitmap_load(struct bitmap_cache *cache, int bitmap, uint8_t reg) {
+    struct logical_bitmap *entry = &cache->entries[bitmap];
+    uint8_t users[GPU_SPRITE_SLOTS] = { 0 };
+    int slot, other, victim = -1, own = -1;
+
+    if (entry->slot >= 0) {
+        return entry->slot;
+    }
+
+    for (other = 1; other < GPU_SPRITE_REGISTERS; other++) {
+        uint32_t value = device->shadow[other];
+
+        if ((device->shadow_known[0] & (1u << other)) && value != 0 && (value & 0x1FF) < GPU_SPRITE_SLOTS) {
+            users[value & 0x1FF]++;
+            own = other == reg ? (int) (value & 0x1FF) : own;
+        }
+    }
+    /* Sem slot livre, o slot que so o proprio registrador mostra é trocado junto com ele */
+    if (own >= 0 && users[own] == 1) {
+        users[own] = 0;
+        for (slot = 0; slot < GPU_SPRITE_SLOTS; slot++) {
+            if ((cache->reserved & (1u << slot)) && !users[slot] && slot != own &&
+                (cache->owner[slot] < 0 || !cache->entries[cache->owner[slot]].pinned)) {
+                users[own] = 1;
+                break;
+            }
+        }
+    }
+    for (slot = 0; slot < GPU_SPRITE_SLOTS; slot++) {
+        if (!(cache->reserved & (1u << slot)) || users[slot] ||
+            (cache->owner[slot] >= 0 && cache->entries[cache->owner[slot]].pinned)) {
+            continue;
+        }
+        if (cache->owner[slot] < 0) {
+            victim = slot;
+            break;
+        }
+        if (victim < 0 || cache->entries[cache->owner[slot]].last_use < cache->entries[cache->owner[victim]].last_use) {
+            victim = slot;
+        }
+    }
+    if (victim < 0) {
+        fprintf(stderr, "No free sprite slot for bitmap %d\n", bitmap);
+        return -1;
+    }
+
+    if (!upload_sprite_bitmap(victim, entry->pixels)) {
+        return -1;
+    }
+    if (cache->owner[victim] >= 0) {
+        cache->entries[cache->owner[victim]].slot = -1;
+    }
+    cache->owner[victim] = bitmap;
+    entry->slot = victim;
+    return victim;
+}
+
+/**
+ * \brief           Usada para esperar os pixels enviados chegarem na GPU antes do registrador que os mostra
+ *
+ * Pixels (WSM) vao para a fila de volume do driver e registradores de sprite (WBR) para a
+ * de latencia, atendida primeiro, entao sem a espera o sprite apareceria com o bitmap
+ * anterior ou pela metade.
+ *
+ * \return          Retorna 0 quando a operação não foi realizada, e 1 quando foi bem sucedida
  */
-int open_gpu_device () {
-    fd = open(DEVICE_PATH, O_WRONLY);
+static int bitmap_wait() {
+    struct gpu_fence fence;
 
-    if (fd < 0) {
-        perror("Failed to open the device");
+    return gpu_get_fence(&fence) && gpu_wait_fence(&fence);
+}
+
+/**
+ * \brief           Usada para setar um sprite na tela com um bitmap logico, enviando o bitmap para a GPU se preciso
+ *
+ * \param[in]       reg: Registrador ao qual o sprite será armazenado
+ * \param[in]       x: Coordenada x do sprite na tela
+ * \param[in]       y: Coordenada y do sprite na tela
+ * \param[in]       bitmap: Bitmap retornado por gpu_bitmap_create()
+ * \param[in]       sp: Ativação do sprite (0 - desativado, 1 - ativado)
+ * \return          Retorna 0 quando a operação não foi realizada, e 1 quando foi bem sucedida
+ */
+int set_sprite_bitmap(uint8_t reg, uint16_t x, uint16_t y, int bitmap, uint8_t sp) {
+    struct bitmap_cache *cache = device->bitmaps;
+    int slot, resident, result;
+
+    if (cache == NULL || bitmap < 0 || (uint32_t) bitmap >= cache->count || !cache->entries[bitmap].alive) {
+        fprintf(stderr, "Invalid bitmap %d\n", bitmap);
         return 0;
     }
-    return 1;
+    if (!sp) {
+        /* Sprite desativado nao precisa do bitmap na GPU */
+        return set_sprite(reg, x, y, 0, 0);
+    }
+
+    cache->entries[bitmap].last_use = ++cache->tick;
+    resident = cache->entries[bitmap].slot >= 0;
+    gpu_begin_batch();
+    slot = bitmap_load(cache, bitmap, reg);
+    result = slot >= 0 && (resident || bitmap_wait()) && set_sprite(reg, x, y, slot, 1);
+    return gpu_submit_batch() && result;
 }
 
 /**
- * \brief           Usada para fechar o arquivo do driver da GPU
+ * \brief           Usada para criar uma animação, deixando todos os quadros na memoria de sprites
+ *
+ * Cada quadro vira um bitmap logico (gpu_bitmap_create()) preso no seu slot, entao
+ * trocar de quadro é so mudar o offset do registrador. Com mirrored, uma copia espelhada
+ * na horizontal de cada quadro tambem é carregada, escolhida com anim->mirror. Os slots
+ * vem dos reservados com gpu_bitmap_reserve(), que devem caber count (ou 2 * count) quadros.
+ *
+ * \param[out]      anim: Animação criada, no quadro 0 e desativada
+ * \param[in]       reg: Registrador de sprite usado pela animação
+ * \param[in]       frames: count bitmaps de GPU_SPRITE_PIXELS cores de 9 bits, um depois do outro
+ * \param[in]       count: Quantidade de quadros, de 1 ate GPU_ANIMATION_FRAMES
+ * \param[in]       mirrored: 1 para carregar tambem os quadros espelhados
+ * \return          Retorna 0 quando a operação não foi realizada, e 1 quando foi bem sucedida
  */
-void close_gpu_devide () {
-    close(fd);
+int gpu_animation_create(Sprite_Animation *anim, uint8_t reg, const uint16_t *frames, uint8_t count, uint8_t mirrored) {
+    struct bitmap_cache *cache = bitmap_cache();
+    uint16_t flipped[GPU_SPRITE_PIXELS];
+    int variant, frame, pixel, slot, result = 1;
+
+    memset(anim, 0, sizeof(*anim));
+    memset(anim->bitmaps, -1, sizeof(anim->bitmaps));
+    if (cache == NULL || count == 0 || count > GPU_ANIMATION_FRAMES || reg == 0 || reg >= GPU_SPRITE_REGISTERS) {
+        fprintf(stderr, "Invalid animation\n");
+        return 0;
+    }
+    anim->data_register = reg;
+    anim->count = count;
+
+    gpu_begin_batch();
+    for (variant = 0; variant <= (mirrored ? 1 : 0) && result; variant++) {
+        for (frame = 0; frame < count && result; frame++) {
+            const uint16_t *pixels = frames + frame * GPU_SPRITE_PIXELS;
+
+            if (variant) {
+                for (pixel = 0; pixel < GPU_SPRITE_PIXELS; pixel++) {
+                    flipped[pixel] = pixels[pixel - pixel % GPU_SPRITE_SIZE + GPU_SPRITE_SIZE - 1 - pixel % GPU_SPRITE_SIZE];
+                }
+                pixels = flipped;
+            }
+
+            anim->bitmaps[variant][frame] = gpu_bitmap_create(pixels);
+            slot = anim->bitmaps[variant][frame] >= 0 ? bitmap_load(cache, anim->bitmaps[variant][frame], 0) : -1;
+            if (slot < 0) {
+                result = 0;
+                break;
+            }
+            cache->entries[anim->bitmaps[variant][frame]].pinned = 1;
+            anim->slots[variant][frame] = slot;
+        }
+    }
+    /* Todos os quadros chegam na GPU antes do primeiro gpu_animation_show() */
+    result = gpu_submit_batch() && result && bitmap_wait();
+
+    if (!result) {
+        gpu_animation_destroy(anim);
+    }
+    return result;
 }
 
 /**
- * \brief           Usada para configurar a cor base do background a partir dos valores de Red, Green e Blue.
- * 
- * \param[in]       R: Valor para a cor vermelha.
- * \param[in]       G: Valor para a cor verde.
- * \param[in]       B: Valor para a cor azul.
+ * \brief           Usada para mostrar a animação no quadro atual, na posição e espelhamento de anim
+ *
+ * Custa uma unica instrução WBR, nenhuma quando nada mudou.
+ *
  * \return          Retorna 0 quando a operação não foi realizada, e 1 quando foi bem sucedida
-*/
-int set_background_color (uint8_t R, uint8_t B, uint8_t G) {
-    unsigned char command[4];
+ */
+int gpu_animation_show(const Sprite_Animation *anim) {
+    uint8_t variant = anim->mirror && anim->bitmaps[1][0] >= 0;
 
-    command[0] = 0;
-    command[1] = R;
-    command[2] = G;
-    command[3] = B;
+    if (anim->count == 0) {
+        return 0;
+    }
+    return set_sprite(anim->data_register, anim->pos_x, anim->pos_y, anim->slots[variant][anim->frame], anim->enable);
+}
 
-    if (write(fd, command, sizeof(command)) < 0) {
-        perror("Failed to write to the device");
+/**
+ * \brief           Usada para avançar a animação um quadro, voltando ao primeiro depois do ultimo, e mostra-la
+ * \return          Retorna 0 quando a operação não foi realizada, e 1 quando foi bem sucedida
+ */
+int gpu_animation_tick(Sprite_Animation *anim) {
+    if (anim->count == 0) {
         return 0;
     }
+    anim->frame = (anim->frame + 1) % anim->count;
+    return gpu_animation_show(anim);
+}
 
-    return 1;
+/**
+ * \brief           Usada para apagar uma animação, desativando o sprite e liberando os slots dos quadros
+ */
+void gpu_animation_destroy(Sprite_Animation *anim) {
+    int variant, frame;
+
+    if (anim->count && anim->enable) {
+        set_sprite(anim->data_register, 0, 0, 0, 0);
+    }
+    for (variant = 0; variant < 2; variant++) {
+        for (frame = 0; frame < GPU_ANIMATION_FRAMES; frame++) {
+            gpu_bitmap_destroy(anim->bitmaps[variant][frame]);
+            anim->bitmaps[variant][frame] = -1;
+        }
+    }
+    anim->count = 0;
 }
 
 /**
- * \brief           Usada para setar um sprite na tela
- * 
- * \param[in]       reg: Registrador ao qual o sprite será armazenado
- * \param[in]       x: Coordenada x do sprite na tela
- * \param[in]       y: Coordenada y do sprite na tela
- * \param[in]       offset: Deslocamento na memória para selecionar o bitmap
- * \param[in]       sp: Ativação do sprite (0 - desativado, 1 - ativado)
- * \return          Retorna 0 quando a operação não foi realizada, e 1 quando foi bem sucedida
-*/
-int set_sprite(uint8_t reg, uint16_t x, uint16_t y, uint8_t offset, uint8_t sp){
-    unsigned char command[7];
+ * \brief           Usada para calcular o hash (FNV-1a de 64 bits) de um bitmap de sprite
+ */
+uint64_t gpu_atlas_hash(const uint16_t pixels[GPU_SPRITE_PIXELS]) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    int i;
 
-    command[0] = 1;
-    command[1] = reg;
-    command[2] = (offset >> 1) & 0xFF;
-    command[3] = ((offset & 0x01) << 7) | ((x >> 3) & 0x7F);
-    command[4] = ((x & 0x07) << 5) | ((y >> 5) & 0x1F);
-    command[5] = (y & 0x1F) << 3;
-    command[6] = sp;
+    for (i = 0; i < GPU_SPRITE_PIXELS; i++) {
+        hash = (hash ^ (pixels[i] & 0xFF)) * 0x100000001b3ULL;
+        hash = (hash ^ (pixels[i] >> 8)) * 0x100000001b3ULL;
+    }
+    return hash;
+}
 
-    if (write(fd, command, sizeof(command)) < 0) {
-        perror("Failed to write to the device");
-        return 0;
+/**
+ * \brief           Usada para carregar na memoria de sprites os bitmaps de um atlas, pulando os que ja estao na GPU
+ *
+ * O atlas (gerado pelo programa sprite_atlas) é mapeado com mmap e cada bitmap é
+ * enviado com upload_sprite_bitmap(). Com state_path, os hashes dos bitmaps carregados
+ * ficam gravados nesse arquivo e uma proxima execução pula os slots que a GPU ja tem.
+ * Escritas posteriores da biblioteca na memoria de sprites tiram o slot do estado.
+ * Use um arquivo de estado por GPU, e apague-o se a placa for reprogramada sem reiniciar.
+ *
+ * \param[in]       path: Arquivo do atlas
+ * \param[in]       state_path: Arquivo de estado, NULL para sempre carregar tudo
+ * \return          Retorna a quantidade de bitmaps enviados, ou -1 quando ocorreu uma falha
+ */
+int gpu_load_atlas(const char *path, const char *state_path) {
+    const struct gpu_atlas_file *header;
+    const struct gpu_atlas_slot *slots;
+    struct atlas_state state;
+    struct stat info;
+    uint32_t i, written = 0;
+    char boot_id[40];
+    void *atlas;
+    int atlas_fd, result = 1;
+    FILE *file;
+
+    atlas_fd = open(path, O_RDONLY);
+    if (atlas_fd < 0) {
+        perror("Failed to open the atlas");
+        return -1;
+    }
+    if (fstat(atlas_fd, &info) < 0 || info.st_size < (off_t) sizeof(*header)) {
+        fprintf(stderr, "Invalid atlas %s\n", path);
+        close(atlas_fd);
+        return -1;
+    }
+    atlas = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, atlas_fd, 0);
+    close(atlas_fd);
+    if (atlas == MAP_FAILED) {
+        perror("Failed to map the atlas");
+        return -1;
     }
 
-    return 1;
+    header = atlas;
+    slots = (const struct gpu_atlas_slot *) (header + 1);
+    /* count é conferido antes da multiplicação, que daria a volta com size_t de 32 bits na placa */
+    if (header->magic != GPU_ATLAS_MAGIC || header->count > (info.st_size - sizeof(*header)) / sizeof(*slots) ||
+        info.st_size != (off_t) (sizeof(*header) + (size_t) header->count * sizeof(*slots))) {
+        fprintf(stderr, "Invalid atlas %s\n", path);
+        munmap(atlas, info.st_size);
+        return -1;
+    }
+
+    /* Estado de uma execução anterior, descartado se a placa foi reiniciada desde entao */
+    free(device->atlas_state);
+    device->atlas_state = NULL;
+    device->atlas_resident = 0;
+    if (state_path != NULL) {
+        device->atlas_state = strdup(state_path);
+        file = fopen(state_path, "rb");
+        if (file != NULL) {
+            atlas_boot_id(boot_id);
+            if (fread(&state, sizeof(state), 1, file) == 1 && state.magic == ATLAS_STATE_MAGIC &&
+                memcmp(state.boot_id, boot_id, sizeof(boot_id)) == 0) {
+                device->atlas_resident = state.resident;
+                memcpy(device->atlas_hashes, state.hashes, sizeof(state.hashes));
+            }
+            fclose(file);
+        }
+    }
+
+    gpu_begin_batch();
+    for (i = 0; i < header->count && result; i++) {
+        const struct gpu_atlas_slot *entry = &slots[i];
+        uint32_t pixel;
+
+        if (entry->slot >= GPU_SPRITE_SLOTS || gpu_atlas_hash(entry->pixels) != entry->hash) {
+            fprintf(stderr, "Invalid atlas slot %u\n", entry->slot);
+            result = 0;
+            break;
+        }
+
+        if ((device->atlas_resident & (1u << entry->slot)) && device->atlas_hashes[entry->slot] == entry->hash) {
+            /* A GPU ja tem o bitmap, so a copia do estado é atualizada */
+            for (pixel = 0; pixel < GPU_SPRITE_PIXELS; pixel++) {
+                uint16_t color = entry->pixels[pixel];
+
+                shadow_store(device, gpu_encode_sprite_pixel(entry->slot * GPU_SPRITE_PIXELS + pixel, color & 0b111,
+                                                             (color >> 3) & 0b111, (color >> 6) & 0b111));
+            }
+            continue;
+        }
+
+        device->atlas_resident &= ~(1u << entry->slot);
+        result = upload_sprite_bitmap(entry->slot, entry->pixels);
+        device->atlas_resident |= 1u << entry->slot;
+        device->atlas_hashes[entry->slot] = entry->hash;
+        written++;
+    }
+    /*
+     * O estado so é gravado depois que os bitmaps chegaram na GPU: o driver envia em segundo
+     * plano e pode descartar comandos pendentes, e um slot gravado como residente sem os
+     * pixels nunca mais seria enviado.
+     */
+    result = gpu_submit_batch() && result && gpu_sync();
+    munmap(atlas, info.st_size);
+
+    if (!result) {
+        device->atlas_resident = 0;
+    }
+    if (device->atlas_state != NULL && !atlas_save(device)) {
+        result = 0;
+    }
+    return result ? (int) written : -1;
 }
 
 /**
- * \brief           Usada para setar um poligono na tela
- * 
- * \param[in]       address: Endereço onde o poligono estará armazenado
- * \param[in]       ref_x: Coordenada x na tela referente ao centro do poligono        
- * \param[in]       ref_y: Coordenada y na tela referente ao centro do poligono                      
- * \param[in]       size: Tamanho do poligono        
- * \param[in]       r: Valor para a cor vermelha 
- * \param[in]       g: Valor para a cor verde 
- * \param[in]       b: Valor para a cor azul    
- * \param[in]       shape: Formato do poligono (0 = quadrado, 1 = triangulo)
- * \return          Retorna 0 quando a operação não foi realizada, e 1 quando foi bem sucedida
-*/
-int set_poligono(uint16_t address, uint16_t ref_x, uint16_t ref_y, uint8_t size, uint8_t r, uint8_t g, uint8_t b, uint8_t shape){
-    unsigned char command[7];
+ * \brief           Usada para executar um carregamento na GPU selecionada nesta thread
+ * \return          Retorna 0 quando o envio falhou, e 1 quando foi bem sucedido
+ */
+static int asset_run(const struct asset_job *job) {
+    int result = 1;
+    int i;
 
-    command[0] = 4; 
-    command[1] = address; 
-    command[2] = ref_x >> 1; 
-    command[3] = ((ref_x & 0b01) << 7) | (ref_y >> 2); 
-    command[4] = ((ref_y & 0b11) << 6) | (size & 0b1111);
-    command[5] = ((r & 0b111)<< 5) | (g & 0b111) << 2; 
-    command[6] = ((b &0b111) << 5) | shape & 0b1;
+    switch (job->type) {
+        case ASSET_SPRITE:
+            return upload_sprite_bitmap(job->slot, job->data);
+        case ASSET_BACKGROUND:
+            gpu_begin_batch();
+            for (i = 0; i < GPU_BACKGROUND_BLOCKS && result; i++) {
+                uint16_t color = job->data[i];
 
-    if (write(fd, command, sizeof(command)) < 0) {
-        perror("Failed to write to the device");
-        return 0;
+                result = send_instruction(gpu_encode_background_block(i, color & 0b111, (color >> 3) & 0b111, (color >> 6) & 0b111));
+            }
+            return gpu_submit_batch() && result;
+        default:
+            gpu_begin_batch();
+            job->load();
+            return gpu_submit_batch();
     }
+}
 
-    return 1;
+/**
+ * \brief           Usada para marcar um carregamento como terminado e acordar quem espera por ele
+ */
+static void asset_finish(struct asset_job *job, int result) {
+    int slot;
+
+    pthread_mutex_lock(&asset_lock);
+    for (slot = 0; slot < GPU_SPRITE_SLOTS; slot++) {
+        if (job->slots & (1u << slot)) {
+            asset_pending[slot]--;
+            asset_failed = result ? asset_failed & ~(1u << slot) : asset_failed | (1u << slot);
+        }
+    }
+    asset_results[job->id] = result ? 1 : -1;
+    pthread_cond_broadcast(&asset_cond);
+    pthread_mutex_unlock(&asset_lock);
+
+    free(job->data);
+    free(job);
 }
 
 /**
- * \brief Usada para modelar o background atraves do preenchimento dos blocos de 8x8 pixels
- * 
- * \param[in]       column: Valor da coluna do bloco.
- * \param[in]       line: Valor da linha do bloco.
- * \param[in]       R: Valor para a cor vermelha.
- * \param[in]       G: Valor para a cor verde.
- * \param[in]       B: Valor para a cor azul.
- * \return          Retorna 0 quando a operação não foi realizada, e 1 quando foi bem sucedida
-*/
-int set_background_block(uint8_t column, uint8_t line, uint8_t R, uint8_t G, uint8_t B){
-    unsigned char command[5];
-    // 0001 1111 1111 1111 000
-    int i = 0;
-    int address = column + (line*80);
+ * \brief           Thread de assets: envia cada carregamento pela sua propria GPU e espera ele chegar
+ *
+ * \param[in]       arg: GPU da thread (asset_worker)
+ */
+static void *asset_main(void *arg) {
+    Gpu_Device *worker = arg;
+    struct gpu_fence fence;
+    struct asset_job *job;
+    size_t i;
+    int result;
+
+    gpu_use_device(worker);
+    for (;;) {
+        pthread_mutex_lock(&asset_lock);
+        while (asset_head == NULL && !asset_stopping) {
+            pthread_cond_wait(&asset_cond, &asset_lock);
+        }
+        job = asset_head;
+        if (job == NULL) {
+            pthread_mutex_unlock(&asset_lock);
+            return NULL;
+        }
+        asset_head = job->next;
+        asset_tail = asset_head != NULL ? asset_tail : NULL;
+        pthread_mutex_unlock(&asset_lock);
+
+        /* A copia do estado desta GPU passa a conter so o que o carregamento escreveu */
+        memset(worker->shadow_known, 0, sizeof(worker->shadow_known));
+        result = asset_run(job);
+        result = result && gpu_get_fence(&fence) && gpu_wait_fence(&fence);
+
+        pthread_mutex_lock(&asset_lock);
+        for (i = 0; i < sizeof(asset_dirty) / sizeof(asset_dirty[0]); i++) {
+            asset_dirty[i] |= worker->shadow_known[i];
+        }
+        __atomic_store_n(&asset_generation, asset_generation + 1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&asset_lock);
+        asset_finish(job, result);
+    }
+}
+
+/**
+ * \brief           Usada para criar a thread de assets com uma segunda GPU aberta no arquivo de owner
+ *
+ * Abrir o arquivo e criar a thread acontecem fora de asset_lock, entao a thread de assets
+ * e quem consulta os carregamentos nao esperam por elas.
+ *
+ * \param[in]       owner: GPU da thread que pediu o carregamento
+ */
+static void asset_start(Gpu_Device *owner) {
+    Gpu_Device *worker;
+    int running;
 
+    pthread_mutex_lock(&asset_start_lock);
+    pthread_mutex_lock(&asset_lock);
+    running = asset_owner != NULL;
+    asset_stopping = 0;
+    pthread_mutex_unlock(&asset_lock);
 
-    command[0] = 2;
-    command[1] = (address >> 5);
-    command[2] = ((address) << 3) | R;
-    command[3] = G;
-    command[4] = B;
+    worker = running ? NULL : open_gpu_device_with(owner->backend, owner->path);
+    if (worker != NULL) {
+        /* Os carregamentos nao atrasam sprites e poligonos da thread que desenha */
+        gpu_use_device(worker);
+        gpu_set_lane(GPU_LANE_BULK);
+        gpu_use_device(owner);
 
-    //printf("address[1]: %d\n", (R & 0b111));
+        if (pthread_create(&asset_thread, NULL, asset_main, worker) != 0) {
+            perror("Failed to start the asset thread");
+            close_gpu_device_at(worker);
+        } else {
+            pthread_mutex_lock(&asset_lock);
+            asset_worker = worker;
+            asset_owner = owner;
+            owner->asset_generation = asset_generation;
+            pthread_mutex_unlock(&asset_lock);
+        }
+    }
+    pthread_mutex_unlock(&asset_start_lock);
+}
 
+/**
+ * \brief           Usada para colocar um carregamento na fila da thread de assets
+ *
+ * A thread é criada no primeiro carregamento, com uma segunda GPU aberta no arquivo da
+ * GPU selecionada. Nos transportes sem driver duas GPUs nao podem escrever ao mesmo
+ * tempo, entao o carregamento é feito na hora, antes de retornar.
+ *
+ * \return          Retorna o numero do asset, ou -1 quando ocorreu uma falha
+ */
+static int asset_queue(struct asset_job *job) {
+    signed char *results;
+    int slot, id;
 
-    if (write(fd, command, sizeof(command)) < 0) {
-        perror("Failed to write to the device");
-        return 0;
+    if (device->backend == &gpu_backend_chardev && __atomic_load_n(&asset_owner, __ATOMIC_ACQUIRE) == NULL) {
+        asset_start(device);
     }
 
-    return 1;
+    pthread_mutex_lock(&asset_lock);
+    results = realloc(asset_results, asset_next_id + 1);
+    if (results == NULL) {
+        pthread_mutex_unlock(&asset_lock);
+        perror("Failed to queue the asset");
+        free(job->data);
+        free(job);
+        return -1;
+    }
+    asset_results = results;
+    asset_results[asset_next_id] = 0;
+    id = job->id = asset_next_id++;
+    for (slot = 0; slot < GPU_SPRITE_SLOTS; slot++) {
+        asset_pending[slot] += (job->slots >> slot) & 1;
+    }
+
+    if (device == asset_owner) {
+        job->next = NULL;
+        if (asset_tail != NULL) {
+            asset_tail->next = job;
+        } else {
+            asset_head = job;
+        }
+        asset_tail = job;
+        pthread_cond_broadcast(&asset_cond);
+        pthread_mutex_unlock(&asset_lock);
+        return id;
+    }
+    pthread_mutex_unlock(&asset_lock);
+
+    /* Sem a thread: carrega agora nesta GPU */
+    asset_finish(job, asset_run(job));
+    return id;
 }
 
 /**
- * \brief           Usada para mudar o valor RGB de um determinado pixel de um sprite com base no endereço de memoria.
- * 
- * \param[in]       address: Endereço de memoria do local que deve ter o valor alterado.
- * \param[in]       R: Valor para a cor vermelha.
- * \param[in]       G: Valor para a cor verde.
- * \param[in]       B: Valor para a cor azul.
- * \return          Retorna 1 quando colisão foi detectada e 0 quando não.
-*/
-int set_sprite_pixel_color( uint16_t address, uint8_t R, uint8_t G, uint8_t B){
-    unsigned char command[6];
+ * \brief           Usada para carregar em segundo plano um bitmap de 20x20 pixels na memoria de sprites
+ *
+ * \param[in]       slot: Bitmap escrito, de 0 ate GPU_SPRITE_SLOTS - 1
+ * \param[in]       pixels: Cores de 9 bits (GPU_COLOR()) linha por linha, copiadas antes de retornar
+ * \return          Retorna o numero do asset (ver gpu_asset_ready()), ou -1 quando ocorreu uma falha
+ */
+int gpu_asset_sprite(uint8_t slot, const uint16_t pixels[GPU_SPRITE_PIXELS]) {
+    struct asset_job *job;
 
-    command[0] = 3; // Command for instrucao_wsm
-    command[1] = (address >> 6); // Higher 8 bits of 14-bit address
-    command[2] = (address & 0b111111); // Lower 6 bits of address and r
-    command[3] = R & 0b111;
-    command[4] = G & 0b111; // g value
-    command[5] = B & 0b111; // b value
+    if (slot >= GPU_SPRITE_SLOTS) {
+        fprintf(stderr, "Invalid sprite slot %u\n", slot);
+        return -1;
+    }
+    job = calloc(1, sizeof(*job));
+    if (job == NULL || (job->data = malloc(GPU_SPRITE_PIXELS * sizeof(*pixels))) == NULL) {
+        perror("Failed to queue the asset");
+        free(job);
+        return -1;
+    }
+    memcpy(job->data, pixels, GPU_SPRITE_PIXELS * sizeof(*pixels));
+    job->type = ASSET_SPRITE;
+    job->slot = slot;
+    job->slots = 1u << slot;
+    return asset_queue(job);
+}
 
-    if (write(fd, command, sizeof(command)) < 0) {
-        perror("Failed to write to the device");
+/**
+ * \brief           Usada para carregar em segundo plano a cor de todos os background blocks
+ *
+ * \param[in]       blocks: Cores de 9 bits dos 80x60 blocos, linha por linha, copiadas antes de retornar
+ * \return          Retorna o numero do asset (ver gpu_asset_ready()), ou -1 quando ocorreu uma falha
+ */
+int gpu_asset_background(const uint16_t blocks[GPU_BACKGROUND_BLOCKS]) {
+    struct asset_job *job = calloc(1, sizeof(*job));
+
+    if (job == NULL || (job->data = malloc(GPU_BACKGROUND_BLOCKS * sizeof(*blocks))) == NULL) {
+        perror("Failed to queue the asset");
+        free(job);
+        return -1;
+    }
+    memcpy(job->data, blocks, GPU_BACKGROUND_BLOCKS * sizeof(*blocks));
+    job->type = ASSET_BACKGROUND;
+    return asset_queue(job);
+}
+
+/**
+ * \brief           Usada para executar em segundo plano uma função que desenha com as funções da biblioteca
+ *
+ * A função roda na thread de assets, dentro de um lote, e suas escritas vao para a GPU
+ * da thread de assets (ex.: draw_sprites_PMD).
+ *
+ * \param[in]       load: Função executada
+ * \param[in]       slots: Mascara dos slots da memoria de sprites que a função escreve (bit N = slot N)
+ * \return          Retorna o numero do asset (ver gpu_asset_ready()), ou -1 quando ocorreu uma falha
+ */
+int gpu_asset_call(void (*load)(void), uint32_t slots) {
+    struct asset_job *job = calloc(1, sizeof(*job));
+
+    if (job == NULL) {
+        perror("Failed to queue the asset");
+        return -1;
+    }
+    job->type = ASSET_CALL;
+    job->load = load;
+    job->slots = slots;
+    return asset_queue(job);
+}
+
+/**
+ * \brief           Usada para saber se um asset ja chegou na GPU
+ * \return          Retorna 1 quando o asset chegou na GPU, 0 enquanto esta na fila e -1 quando falhou
+ */
+int gpu_asset_ready(int asset) {
+    int result = -1;
+
+    pthread_mutex_lock(&asset_lock);
+    if (asset >= 0 && asset < asset_next_id) {
+        result = asset_results[asset];
+    }
+    pthread_mutex_unlock(&asset_lock);
+    return result;
+}
+
+/**
+ * \brief           Usada para esperar um asset chegar na GPU
+ *
+ * \param[in]       asset: Numero do asset, -1 para esperar todos
+ * \return          Retorna 1 quando os assets chegaram na GPU, e 0 quando algum falhou
+ */
+int gpu_asset_wait(int asset) {
+    int first = asset < 0 ? 0 : asset, last, result = 1;
+
+    pthread_mutex_lock(&asset_lock);
+    last = asset < 0 ? asset_next_id - 1 : asset;
+    for (asset = first; asset <= last && asset < asset_next_id; asset++) {
+        while (asset_results[asset] == 0) {
+            pthread_cond_wait(&asset_cond, &asset_lock);
+        }
+        result = result && asset_results[asset] > 0;
+    }
+    pthread_mutex_unlock(&asset_lock);
+    return result;
+}
+
+/**
+ * \brief           Usada para saber se um bitmap da memoria de sprites ja pode ser mostrado
+ *
+ * Feita para ativar um sprite so depois do seu bitmap carregar, por exemplo
+ * set_sprite(reg, x, y, offset, gpu_slot_ready(offset)).
+ *
+ * \return          Retorna 1 quando nenhum carregamento do slot esta na fila e o ultimo nao falhou, e 0 caso contrario
+ */
+int gpu_slot_ready(uint8_t slot) {
+    int ready;
+
+    if (slot >= GPU_SPRITE_SLOTS) {
         return 0;
     }
+    pthread_mutex_lock(&asset_lock);
+    ready = asset_pending[slot] == 0 && !(asset_failed & (1u << slot));
+    pthread_mutex_unlock(&asset_lock);
+    return ready;
+}
+
+/**
+ * \brief           Usada para terminar os carregamentos na fila e parar a thread de assets
+ *
+ * Chamada tambem ao fechar a GPU que iniciou os carregamentos.
+ */
+void gpu_assets_stop() {
+    Gpu_Device *worker;
+
+    pthread_mutex_lock(&asset_start_lock);
+    pthread_mutex_lock(&asset_lock);
+    if (asset_owner == NULL) {
+        pthread_mutex_unlock(&asset_lock);
+        pthread_mutex_unlock(&asset_start_lock);
+        return;
+    }
+    asset_stopping = 1;
+    pthread_cond_broadcast(&asset_cond);
+    pthread_mutex_unlock(&asset_lock);
+    pthread_join(asset_thread, NULL);
 
-    return 1;
+    pthread_mutex_lock(&asset_lock);
+    worker = asset_worker;
+    asset_worker = NULL;
+    asset_owner = NULL;
+    pthread_mutex_unlock(&asset_lock);
+    close_gpu_device_at(worker);
+    pthread_mutex_unlock(&asset_start_lock);
 }
 
 /**
@@ -266,18 +2542,30 @@ int collision(Sprite *sp1, Sprite *sp2){
 
 }
 
+/**
+ * \brief           Usada para pintar um retangulo de background blocks com uma unica cor, expandido pelo driver
+ *
+ * \param[in]       column: Coluna do canto superior esquerdo do retangulo.
+ * \param[in]       line: Linha do canto superior esquerdo do retangulo.
+ * \param[in]       width: Quantidade de colunas do retangulo.
+ * \param[in]       height: Quantidade de linhas do retangulo.
+ * \param[in]       R: Valor para a cor vermelha.
+ * \param[in]       G: Valor para a cor verde.
+ * \param[in]       B: Valor para a cor azul.
+ * \return          Retorna 0 quando a operação não foi realizada, e 1 quando foi bem sucedida
+ */
+int fill_background_rect(uint8_t column, uint8_t line, uint8_t width, uint8_t height, uint8_t R, uint8_t G, uint8_t B) {
+    struct gpu_command command;
+
+    gpu_pack_fill_blocks(&command, column, line, width, height, R, G, B);
+    return send_command(command.bytes, sizeof(command.bytes));
+}
+
 /**
  * \brief           Usada para setar o valor "510" no RGB de todos os background blocks, assim fazendo eles copiar a cor padrão do background
  */
 void clear_background_blocks() {
-    int i = 0;
-    int j = 0;
-    for (i; i <60; i++){
-        for (j; j < 80; j++){
-            set_background_block(j, i, 6, 7, 7);
-        }
-        j = 0;
-    }
+    fill_background_rect(0, 0, 80, 60, 6, 7, 7);
 }
 
 /**
@@ -285,13 +2573,8 @@ void clear_background_blocks() {
  * \param[in]       line: Valor da linha da tela 60x80
  */
 void fill_background_blocks (uint8_t line) {
-    int i = line;
-    int j = 0;
-    for (i; i <60; i++){
-        for (j; j < 80; j++){
-            set_background_block(j, i, 2, 5, 0);
-        }
-        j = 0;
+    if (line < 60) {
+        fill_background_rect(0, line, 80, 60 - line, 2, 5, 0);
     }
 }
 
@@ -299,26 +2582,27 @@ void fill_background_blocks (uint8_t line) {
  * \brief           Usada para colocar o valor 0 como o tamanho de todo os poligonos que estão na memoria, assim desativando ele
  */
 void clear_poligonos(){
-    int i = 0;
-    for (i; i < 15; i++){
-        set_poligono(i, 0, 0, 0, 0, 0, 0, 0);
-    }
+    struct gpu_command command;
+
+    gpu_pack_clear_polygons(&command, 0, 15);
+    send_command(command.bytes, sizeof(command.bytes));
 }
 
 /**
  * \brief           Usada para desativar todos os sprite que estão nos registradores 1 até 31
  */
 void clear_sprites(){
-    int i = 1;
-    for (i; i< 32; i++){
-        set_sprite(i, 0, 0, 0, 0);
-    }
+    struct gpu_command command;
+
+    gpu_pack_clear_sprites(&command, 1, 31);
+    send_command(command.bytes, sizeof(command.bytes));
 }
 
 /**
  * \brief           Usada para desenhar nos sprites de endereço 25, 26 e 27 a palavra ANF, RANS e ERAI rescpectivamente
  */
 void draw_sprites_anfranserai() {
+    gpu_begin_batch();
     /* A N F parte */
     set_sprite_pixel_color(10124, 7, 0, 0);
     set_sprite_pixel_color(10128, 7, 0, 0);
@@ -501,12 +2785,14 @@ void draw_sprites_anfranserai() {
     set_sprite_pixel_color(11053, 7, 0, 0);
     set_sprite_pixel_color(11057, 7, 0, 0);
     set_sprite_pixel_color(11059, 7, 0, 0);
+    gpu_submit_batch();
 }
 
 /**
  * \brief           Usada para desenhar nos sprites de endereço 28, 29 e 30 as letras P, M e D respectivamente
  */
 void draw_sprites_PMD() {
+    gpu_begin_batch();
     /* LETRA P EM VERDE */
     set_sprite_pixel_color(11265, 0, 7, 0);
     set_sprite_pixel_color(11266, 0, 7, 0);
@@ -753,4 +3039,5 @@ void draw_sprites_PMD() {
     set_sprite_pixel_color(12349, 7, 7, 7);
     set_sprite_pixel_color(12350, 7, 7, 7);
     set_sprite_pixel_color(12351, 7, 7, 7);
+    gpu_submit_batch();
 }
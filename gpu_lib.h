@@ -38,6 +38,7 @@
 
 
 #include <stdint.h>
+#include "gpu_driver.h"
 
 #define LEFT 0
 #define RIGHT 4
@@ -48,10 +49,127 @@
 #define BOTTOM_LEFT 5
 #define BOTTOM_RIGHT 7
 
-#define DEVICE_PATH "/dev/gpu_driver"
+#define DEVICE_PATH "/dev/gpu_driver0"
+
+/* Cor de 9 bits usada nos bitmaps de upload_sprite_bitmap(), com cada componente de 0 a 7 */
+#define GPU_COLOR(r, g, b) ((uint16_t) ((((b) & 0b111) << 6) | (((g) & 0b111) << 3) | ((r) & 0b111)))
 
 extern int fd;      /*Variavel para guardar acesso ao arquivo do kernel*/
 
+/* Tipos de registro do rastreamento */
+#define GPU_TRACE_COMMAND 0                          /* Comando enviado ou acumulado no lote */
+#define GPU_TRACE_FRAME 1                            /* Marca de inicio de quadro (gpu_trace_frame()) */
+
+/* Identifica um arquivo gravado por gpu_trace_dump() */
+#define GPU_TRACE_MAGIC 0x47505554
+
+/**
+ * \brief           Registro do rastreamento de comandos, gravado em ordem por gpu_trace_dump().
+ */
+struct gpu_trace_entry {
+    uint64_t sequence;                               /*!< Numero do registro, comecando em 1. */
+    uint64_t time_ns;                                /*!< Momento do registro em CLOCK_MONOTONIC. */
+    struct gpu_command command;                      /*!< Comando no formato dos lotes (so em GPU_TRACE_COMMAND). */
+    uint16_t type;                                   /*!< GPU_TRACE_COMMAND ou GPU_TRACE_FRAME. */
+    uint16_t length;                                 /*!< Tamanho do comando em bytes. */
+    int32_t result;                                  /*!< Retorno do envio, 1 sucesso e 0 falha. */
+};
+
+/**
+ * \brief           Cabeçalho do arquivo gravado por gpu_trace_dump(), seguido de count registros.
+ */
+struct gpu_trace_file {
+    uint32_t magic;                                  /*!< Sempre GPU_TRACE_MAGIC. */
+    uint32_t count;                                  /*!< Quantidade de registros gravados. */
+    uint64_t lost;                                   /*!< Registros sobrescritos antes da gravação. */
+};
+
+/* Tipos de registro da gravação */
+#define GPU_RECORD_COMMAND 0                         /* Comando enviado ou acumulado no lote */
+#define GPU_RECORD_FRAME 1                           /* Marca de inicio de quadro (gpu_trace_frame()) */
+#define GPU_RECORD_BEGIN 2                           /* gpu_begin_batch() mais externo */
+#define GPU_RECORD_SUBMIT 3                          /* gpu_submit_batch() mais externo */
+
+/* Identifica um arquivo gravado por gpu_record_start() */
+#define GPU_RECORD_MAGIC 0x47505252
+
+/**
+ * \brief           Cabeçalho de cada registro da gravação, seguido de length bytes do comando
+ */
+struct gpu_record_entry {
+    uint32_t delta_ns;                               /*!< Tempo desde o registro anterior, saturado em UINT32_MAX. */
+    uint16_t type;                                   /*!< Um dos GPU_RECORD_*. */
+    uint16_t length;                                 /*!< Bytes do comando que seguem o registro (so em GPU_RECORD_COMMAND). */
+};
+
+/**
+ * \brief           Cabeçalho do arquivo de gravação, os registros seguem ate o fim do arquivo
+ */
+struct gpu_record_file {
+    uint32_t magic;                                  /*!< Sempre GPU_RECORD_MAGIC. */
+    uint32_t reserved;
+};
+
+/* Identifica um arquivo de bitmaps de sprites (atlas) */
+#define GPU_ATLAS_MAGIC 0x41555047
+
+/**
+ * \brief           Cabeçalho do atlas, seguido de count struct gpu_atlas_slot
+ */
+struct gpu_atlas_file {
+    uint32_t magic;                                  /*!< Sempre GPU_ATLAS_MAGIC. */
+    uint32_t count;                                  /*!< Quantidade de bitmaps no arquivo. */
+};
+
+/**
+ * \brief           Bitmap de um slot da memoria de sprites dentro do atlas
+ */
+struct gpu_atlas_slot {
+    uint32_t slot;                                   /*!< Bitmap da GPU escrito, o offset usado em set_sprite(). */
+    uint32_t reserved;
+    uint64_t hash;                                   /*!< gpu_atlas_hash() de pixels. */
+    uint16_t pixels[GPU_SPRITE_PIXELS];              /*!< Cores de 9 bits, linha por linha. */
+};
+
+/**
+ * \brief           GPU aberta com open_gpu_device_at(), um por /dev/gpu_driverN.
+ */
+typedef struct gpu_device Gpu_Device;
+
+/**
+ * \brief           Transporte usado por uma GPU aberta (ver open_gpu_device_with()).
+ */
+typedef struct gpu_backend Gpu_Backend;
+
+extern const Gpu_Backend gpu_backend_chardev;        /* Driver gpu_driver, padrao de open_gpu_device() */
+extern const Gpu_Backend gpu_backend_mmio;           /* Registradores da ponte mapeados por /dev/mem ou UIO, sem o driver */
+extern const Gpu_Backend gpu_backend_sim;            /* Simulador das filas da GPU no proprio processo */
+
+/**
+ * \brief           Tempos e profundidade das filas DATA_A/DATA_B simuladas.
+ */
+struct gpu_sim_config {
+    uint32_t fifo_depth;                             /*!< Instruções que cabem na fila antes de WRFULL. */
+    uint32_t drain_ns;                               /*!< Tempo que a GPU leva para consumir uma instrução. */
+    uint32_t write_ns;                               /*!< Tempo gasto escrevendo uma instrução nos registradores. */
+    uint32_t poll_ns;                                /*!< Intervalo entre leituras de WRFULL com a fila cheia. */
+    void (*observer)(void *context, struct gpu_instruction instruction); /*!< Chamada com cada instrução aceita, ou NULL. */
+    void *observer_context;                          /*!< Primeiro parametro de observer (ex.: gpu_render_observer()). */
+};
+
+/* Configuração padrao do simulador, proxima da GPU na DE1-SoC */
+#define GPU_SIM_DEFAULTS { .fifo_depth = 16, .drain_ns = 10000, .write_ns = 500, .poll_ns = 50000 }
+
+/**
+ * \brief           Contadores do simulador, lidos com gpu_sim_get_stats().
+ */
+struct gpu_sim_stats {
+    uint64_t instructions[4];                        /*!< Instruções escritas, indexadas pelo OPCODE. */
+    uint64_t stalls;                                 /*!< Escritas que encontraram WRFULL. */
+    uint64_t stall_ns;                               /*!< Tempo total esperando WRFULL cair. */
+    uint32_t max_level;                              /*!< Maior ocupação da fila. */
+};
+
 /**
  * \brief           Struct usada para sprits moveis.
  */
@@ -78,22 +196,92 @@ uint16_t data_register;                              /*!< Indica o registrador d
 uint16_t enable;                                     /*!< Habilita/Desabilita a impressao do ̃sprite em um determinado momento. */
 } Sprite_Fixed;
 
-uint8_t set_sprite( uint8_t reg, uint16_t x, uint16_t y, uint8_t offset, uint8_t sp);
+/* Quantidade maxima de quadros de uma animação */
+#define GPU_ANIMATION_FRAMES 16
+
+/**
+ * \brief           Sprite animado, criado com gpu_animation_create().
+ */
+typedef struct{
+uint16_t pos_x;                                      /*!< Armazena a coordenada X do sprite. */
+uint16_t pos_y;                                      /*!< Armazena a coordenada Y do sprite. */
+uint8_t data_register;                               /*!< Registrador de sprite usado pela animação. */
+uint8_t enable;                                      /*!< Habilita/Desabilita a impressao do sprite. */
+uint8_t mirror;                                      /*!< Mostra os quadros espelhados na horizontal (se foram carregados). */
+uint8_t frame;                                       /*!< Quadro mostrado, de 0 ate count - 1. */
+uint8_t count;                                       /*!< Quantidade de quadros. */
+uint8_t slots[2][GPU_ANIMATION_FRAMES];              /*!< Slot de cada quadro, normal e espelhado. */
+int bitmaps[2][GPU_ANIMATION_FRAMES];                /*!< Bitmap logico de cada quadro, -1 quando nao existe. */
+} Sprite_Animation;
+
+int set_sprite( uint8_t reg, uint16_t x, uint16_t y, uint8_t offset, uint8_t sp);
+
+int set_poligono( uint16_t address, uint16_t ref_x, uint16_t ref_y, uint8_t size, uint8_t r, uint8_t g, uint8_t b, uint8_t shape);
+
+int set_background_block( uint8_t column, uint8_t line, uint8_t R, uint8_t G, uint8_t B);
+
+int set_background_color(uint8_t R, uint8_t G, uint8_t B);
+
+int collision(Sprite *sp1, Sprite *sp2);
+
+int set_sprite_pixel_color( uint16_t address, uint8_t R, uint8_t G, uint8_t B);
+
+int upload_sprite_bitmap(uint8_t slot, const uint16_t pixels[GPU_SPRITE_PIXELS]);
+
+int gpu_bitmap_reserve(uint32_t slots);
+
+int gpu_bitmap_create(const uint16_t pixels[GPU_SPRITE_PIXELS]);
+
+void gpu_bitmap_destroy(int bitmap);
+
+int gpu_bitmap_slot(int bitmap);
 
-uint8_t set_poligono( uint16_t address, uint16_t ref_x, uint16_t ref_y, uint8_t size, uint8_t r, uint8_t g, uint8_t b, uint8_t shape);
+int set_sprite_bitmap(uint8_t reg, uint16_t x, uint16_t y, int bitmap, uint8_t sp);
 
-uint8_t set_background_block( uint8_t column, uint8_t line, uint8_t R, uint8_t G, uint8_t B);
+int gpu_animation_create(Sprite_Animation *anim, uint8_t reg, const uint16_t *frames, uint8_t count, uint8_t mirrored);
 
-uint8_t set_background_color(uint8_t R, uint8_t G, uint8_t B);
+int gpu_animation_show(const Sprite_Animation *anim);
 
-uint8_t collision(Sprite *sp1, Sprite *sp2);
+int gpu_animation_tick(Sprite_Animation *anim);
 
-uint8_t set_sprite_pixel_color( uint16_t address, uint8_t R, uint8_t G, uint8_t B);
+void gpu_animation_destroy(Sprite_Animation *anim);
 
-uint8_t open_gpu_device ();
+uint64_t gpu_atlas_hash(const uint16_t pixels[GPU_SPRITE_PIXELS]);
+
+int gpu_load_atlas(const char *path, const char *state_path);
+
+int gpu_asset_sprite(uint8_t slot, const uint16_t pixels[GPU_SPRITE_PIXELS]);
+
+int gpu_asset_background(const uint16_t blocks[GPU_BACKGROUND_BLOCKS]);
+
+int gpu_asset_call(void (*load)(void), uint32_t slots);
+
+int gpu_asset_ready(int asset);
+
+int gpu_asset_wait(int asset);
+
+int gpu_slot_ready(uint8_t slot);
+
+void gpu_assets_stop();
+
+int open_gpu_device ();
 
 void close_gpu_devide ();
 
+Gpu_Device *open_gpu_device_at(const char *path);
+
+void close_gpu_device_at(Gpu_Device *gpu);
+
+Gpu_Device *open_gpu_device_with(const Gpu_Backend *backend, const char *path);
+
+const Gpu_Backend *gpu_find_backend(const char *name);
+
+Gpu_Device *open_gpu_simulator(const struct gpu_sim_config *config);
+
+int gpu_sim_get_stats(struct gpu_sim_stats *stats);
+
+Gpu_Device *gpu_use_device(Gpu_Device *gpu);
+
 void increase_coordinate(Sprite *sp, uint8_t mirror);
 
 void clear_background_blocks();
@@ -102,10 +290,44 @@ void clear_poligonos();
 
 void fill_background_blocks (uint8_t line);
 
+int fill_background_rect(uint8_t column, uint8_t line, uint8_t width, uint8_t height, uint8_t R, uint8_t G, uint8_t B);
+
 void clear_sprites();
 
 void draw_sprites_anfranserai();
 
 void draw_sprites_PMD();
 
+void gpu_begin_batch();
+
+int gpu_submit_batch();
+
+int gpu_get_fence(struct gpu_fence *fence);
+
+int gpu_wait_fence(const struct gpu_fence *fence);
+
+int gpu_get_stats(struct gpu_stats *stats);
+
+int gpu_set_lane(int lane);
+
+int gpu_sync();
+
+int gpu_resync(int clear);
+
+uint64_t gpu_elided_writes();
+
+int gpu_trace_start(uint32_t entries);
+
+void gpu_trace_stop();
+
+void gpu_trace_frame();
+
+int gpu_trace_dump(const char *path);
+
+int gpu_record_start(const char *path);
+
+int gpu_record_stop();
+
+int gpu_send_command(const struct gpu_command *command, uint16_t length);
+
 #endif /* GPU_LIB_H */
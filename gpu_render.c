@@ -0,0 +1,266 @@
+/**
+ * \file            gpu_render.c
+ * \brief           Renderizador de referencia: executa as instruções da GPU e desenha o quadro de 640x480
+ */
+
+/*
+ * Copyright (c) 2024 Pedro Henrique Araujo Almeida, Dermeval Neves de Oliveira Filho, Matheus
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE
+ * AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of library_name.
+ *
+ * Author:          Pedro Henrique ARAUJO ALMEIDA <phaalmeida1\gmail.com>
+ *                  Dermeval Neves de Oliveira Filho <dermevalneves\gmail.com>
+ *                  Matheus Mota Santos<matheuzwork\gmail.com>
+ */
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "gpu_render.h"
+
+/**
+ * \brief           Usada para colocar as memorias no estado em que a GPU liga
+ *
+ * Background preto, sprites e poligonos desativados, blocos e bitmaps transparentes.
+ */
+void gpu_render_init(struct gpu_render_state *state) {
+    int i;
+
+    memset(state, 0, sizeof(*state));
+    for (i = 0; i < GPU_SPRITE_MEMORY_SIZE; i++) {
+        state->sprite_memory[i] = GPU_COLOR_TRANSPARENT;
+    }
+    for (i = 0; i < GPU_BACKGROUND_BLOCKS; i++) {
+        state->background_blocks[i] = GPU_COLOR_TRANSPARENT;
+    }
+}
+
+/**
+ * \brief           Usada para executar uma instrução nas memorias, como a GPU faria
+ *
+ * Instruções com endereço fora das memorias sao ignoradas.
+ */
+void gpu_render_execute(struct gpu_render_state *state, struct gpu_instruction instruction) {
+    uint32_t address = instruction.data_a >> 4;
+
+    switch (instruction.data_a & 0b11) {
+        case GPU_OPCODE_WBR:
+            if (address < GPU_SPRITE_REGISTERS) {
+                state->registers[address] = instruction.data_b;
+            }
+            break;
+        case GPU_OPCODE_WSM:
+            if (address < GPU_SPRITE_MEMORY_SIZE) {
+                state->sprite_memory[address] = instruction.data_b & 0x1FF;
+            }
+            break;
+        case GPU_OPCODE_WBM:
+            if (address < GPU_BACKGROUND_BLOCKS) {
+                state->background_blocks[address] = instruction.data_b & 0x1FF;
+            }
+            break;
+        default:
+            if (address < GPU_POLYGONS) {
+                state->polygons[address] = instruction.data_b;
+            }
+            break;
+    }
+}
+
+/**
+ * \brief           Usada como observador do simulador (ver struct gpu_sim_config), state é uma struct gpu_render_state
+ */
+void gpu_render_observer(void *state, struct gpu_instruction instruction) {
+    gpu_render_execute(state, instruction);
+}
+
+/**
+ * \brief           Usada para pintar um trecho de uma linha com uma cor
+ */
+static void fill_span(uint16_t *line, int start, int end, uint16_t color) {
+    int x;
+
+    if (start < 0) {
+        start = 0;
+    }
+    if (end > GPU_SCREEN_WIDTH) {
+        end = GPU_SCREEN_WIDTH;
+    }
+    for (x = start; x < end; x++) {
+        line[x] = color;
+    }
+}
+
+/**
+ * \brief           Usada para desenhar os background blocks, blocos transparentes mostram a cor do background
+ */
+static void draw_background(const struct gpu_render_state *state, uint16_t *frame) {
+    uint16_t background = state->registers[0] & 0x1FF;
+    int column, block_line, y;
+
+    for (block_line = 0; block_line < GPU_SCREEN_HEIGHT / GPU_BLOCK_SIZE; block_line++) {
+        uint16_t *first = frame + block_line * GPU_BLOCK_SIZE * GPU_SCREEN_WIDTH;
+
+        /* Monta a primeira linha de pixels dos blocos e copia para as outras 7 */
+        for (column = 0; column < GPU_SCREEN_WIDTH / GPU_BLOCK_SIZE; column++) {
+            uint16_t color = state->background_blocks[block_line * (GPU_SCREEN_WIDTH / GPU_BLOCK_SIZE) + column];
+
+            fill_span(first, column * GPU_BLOCK_SIZE, (column + 1) * GPU_BLOCK_SIZE,
+                      color == GPU_COLOR_TRANSPARENT ? background : color);
+        }
+        for (y = 1; y < GPU_BLOCK_SIZE; y++) {
+            memcpy(first + y * GPU_SCREEN_WIDTH, first, GPU_SCREEN_WIDTH * sizeof(*frame));
+        }
+    }
+}
+
+/**
+ * \brief           Usada para desenhar um poligono da instrução DP
+ *
+ * O ponto de referencia é o centro do poligono. O tamanho 0 desativa o poligono e o
+ * tamanho n desenha um quadrado (ou triangulo com a ponta para cima) de 10 * (n + 1) pixels de lado.
+ */
+static void draw_polygon(uint32_t polygon, uint16_t *frame) {
+    int ref_x = polygon & 0x1FF;
+    int ref_y = (polygon >> 9) & 0x1FF;
+    int size = (polygon >> 18) & 0b1111;
+    uint16_t color = (polygon >> 22) & 0x1FF;
+    int triangle = polygon >> 31;
+    int side, top, left, y;
+
+    if (size == 0) {
+        return;
+    }
+
+    side = 10 * (size + 1);
+    top = ref_y - side / 2;
+    left = ref_x - side / 2;
+    for (y = top < 0 ? 0 : top; y < top + side && y < GPU_SCREEN_HEIGHT; y++) {
+        if (triangle) {
+            /* Altura igual a base: a meia largura cresce meio pixel por linha a partir da ponta */
+            int half = (y - top + 1) / 2;
+
+            fill_span(frame + y * GPU_SCREEN_WIDTH, ref_x - half, ref_x + half, color);
+        } else {
+            fill_span(frame + y * GPU_SCREEN_WIDTH, left, left + side, color);
+        }
+    }
+}
+
+/**
+ * \brief           Usada para desenhar um sprite de 20x20 pixels com o canto superior esquerdo em (x, y)
+ *
+ * Pixels com a cor GPU_COLOR_TRANSPARENT nao sao desenhados.
+ */
+static void draw_sprite(const struct gpu_render_state *state, uint32_t sprite, uint16_t *frame) {
+    int x = (sprite >> 19) & 0x3FF;
+    int y = (sprite >> 9) & 0x3FF;
+    uint32_t offset = sprite & 0x1FF;
+    int width = GPU_SPRITE_SIZE, row, column;
+    const uint16_t *bitmap;
+
+    if (!((sprite >> 29) & 1) || offset >= GPU_SPRITE_SLOTS ||
+        x >= GPU_SCREEN_WIDTH || y >= GPU_SCREEN_HEIGHT) {
+        return;
+    }
+
+    bitmap = state->sprite_memory + offset * GPU_SPRITE_PIXELS;
+    if (x + width > GPU_SCREEN_WIDTH) {
+        width = GPU_SCREEN_WIDTH - x;
+    }
+    for (row = 0; row < GPU_SPRITE_SIZE && y + row < GPU_SCREEN_HEIGHT; row++) {
+        const uint16_t *source = bitmap + row * GPU_SPRITE_SIZE;
+        uint16_t *line = frame + (y + row) * GPU_SCREEN_WIDTH + x;
+
+        /* Sem desvio por pixel, o compilador vetoriza a escolha */
+        for (column = 0; column < width; column++) {
+            line[column] = source[column] == GPU_COLOR_TRANSPARENT ? line[column] : source[column];
+        }
+    }
+}
+
+/**
+ * \brief           Usada para desenhar o quadro que a GPU mostraria com as memorias atuais
+ *
+ * Da camada de baixo para a de cima: cor do background, background blocks, poligonos e
+ * sprites. Poligonos e sprites de endereço menor ficam na frente.
+ *
+ * \param[in]       state: Memorias da GPU
+ * \param[out]      frame: GPU_SCREEN_WIDTH * GPU_SCREEN_HEIGHT cores de 9 bits, linha por linha
+ */
+void gpu_render_frame(const struct gpu_render_state *state, uint16_t *frame) {
+    int i;
+
+    draw_background(state, frame);
+    for (i = GPU_POLYGONS - 1; i >= 0; i--) {
+        draw_polygon(state->polygons[i], frame);
+    }
+    for (i = GPU_SPRITE_REGISTERS - 1; i >= 1; i--) {
+        draw_sprite(state, state->registers[i], frame);
+    }
+}
+
+/**
+ * \brief           Usada para calcular um resumo (FNV-1a de 64 bits) de um quadro, para comparar com uma imagem de referencia
+ */
+uint64_t gpu_render_hash(const uint16_t *frame) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    int i;
+
+    for (i = 0; i < GPU_SCREEN_WIDTH * GPU_SCREEN_HEIGHT; i++) {
+        hash = (hash ^ (frame[i] & 0xFF)) * 0x100000001b3ULL;
+        hash = (hash ^ (frame[i] >> 8)) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/**
+ * \brief           Usada para gravar um quadro em uma imagem PPM, com cada componente de 3 bits expandido para 8
+ * \return          Retorna 0 quando a operação não foi realizada, e 1 quando foi bem sucedida
+ */
+int gpu_render_write_ppm(const uint16_t *frame, const char *path) {
+    FILE *file = fopen(path, "wb");
+    int i;
+
+    if (file == NULL) {
+        perror("Failed to open the image");
+        return 0;
+    }
+
+    fprintf(file, "P6\n%d %d\n255\n", GPU_SCREEN_WIDTH, GPU_SCREEN_HEIGHT);
+    for (i = 0; i < GPU_SCREEN_WIDTH * GPU_SCREEN_HEIGHT; i++) {
+        unsigned char rgb[3];
+
+        rgb[0] = (frame[i] & 0b111) * 255 / 7;
+        rgb[1] = ((frame[i] >> 3) & 0b111) * 255 / 7;
+        rgb[2] = ((frame[i] >> 6) & 0b111) * 255 / 7;
+        fwrite(rgb, sizeof(rgb), 1, file);
+    }
+
+    if (fclose(file) != 0) {
+        perror("Failed to write the image");
+        return 0;
+    }
+    return 1;
+}
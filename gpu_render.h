@@ -0,0 +1,71 @@
+/**
+ * \file            gpu_render.h
+ * \brief           Header do renderizador de referencia, que desenha no computador o quadro que a GPU desenharia
+ */
+
+/*
+ * Copyright (c) 2024 Pedro Henrique Araujo Almeida, Dermeval Neves de Oliveira Filho, Matheus
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE
+ * AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of library_name.
+ *
+ * Author:          Pedro Henrique ARAUJO ALMEIDA <phaalmeida1\gmail.com>
+ *                  Dermeval Neves de Oliveira Filho <dermevalneves\gmail.com>
+ *                  Matheus Mota Santos<matheuzwork\gmail.com>
+ */
+
+#ifndef GPU_RENDER_H
+#define GPU_RENDER_H
+
+#include <stdint.h>
+#include "gpu_driver.h"
+
+/* Resolução da saida VGA da GPU */
+#define GPU_SCREEN_WIDTH 640
+#define GPU_SCREEN_HEIGHT 480
+
+/* Lado dos background blocks, em pixels */
+#define GPU_BLOCK_SIZE 8
+
+/**
+ * \brief           Memorias da GPU, alteradas pelas instruções recebidas.
+ */
+struct gpu_render_state {
+    uint32_t registers[GPU_SPRITE_REGISTERS];        /*!< DATA_B de cada WBR, o registrador 0 é a cor do background. */
+    uint16_t sprite_memory[GPU_SPRITE_MEMORY_SIZE];  /*!< Cor de 9 bits de cada pixel dos bitmaps. */
+    uint16_t background_blocks[GPU_BACKGROUND_BLOCKS]; /*!< Cor de 9 bits de cada bloco. */
+    uint32_t polygons[GPU_POLYGONS];                 /*!< DATA_B de cada DP. */
+};
+
+void gpu_render_init(struct gpu_render_state *state);
+
+void gpu_render_execute(struct gpu_render_state *state, struct gpu_instruction instruction);
+
+void gpu_render_observer(void *state, struct gpu_instruction instruction);
+
+void gpu_render_frame(const struct gpu_render_state *state, uint16_t *frame);
+
+uint64_t gpu_render_hash(const uint16_t *frame);
+
+int gpu_render_write_ppm(const uint16_t *frame, const char *path);
+
+#endif /* GPU_RENDER_H */
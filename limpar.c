@@ -42,10 +42,12 @@ int main()
     if (open_gpu_device() == 0)
         return 0;
 
+    gpu_begin_batch(); /* Envia toda a limpeza em uma unica chamada ao driver */
 	set_background_color(0, 0, 0); /* Retorna o background para a cor preta */
     clear_background_blocks(); /* Limpa todos os background blocks */
 	clear_poligonos(); /* Limpa todo os poligono */
 	clear_sprites(); /* Limpa todos os sprites */
+    gpu_submit_batch();
 
 	close_gpu_devide(); /* Fecha o arquivo do driver da GPU */
 }
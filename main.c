@@ -39,15 +39,19 @@
 #include <stdint.h>
 #include "gpu_lib.h"
 
-int main()
+int main(int argc, char *argv[])
 {   
     /* Tentar abrir o arquivo do kernel do driver da GPU */
     if (open_gpu_device() == 0)
         return 0;
 
+    /* Grava os comandos enviados no arquivo passado na linha de comando, para o gpu_replay */
+    if (argc > 1 && gpu_record_start(argv[1]) == 0)
+        return 0;
+
     set_background_color(0, 0, 0); /* Coloca a cor do background como preto */
-    draw_sprites_anfranserai(); /* Desenha na memoria de sprites a palavra anfranerai */
-    draw_sprites_PMD(); /* Desenha na memoria de sprites as letras P, M e D*/
+    gpu_asset_call(draw_sprites_anfranserai, 7u << 25); /* Desenha em segundo plano nos slots 25 a 27 a palavra anfranerai */
+    gpu_asset_call(draw_sprites_PMD, 7u << 28); /* Desenha em segundo plano nos slots 28 a 30 as letras P, M e D*/
 
     /* DESENHA TODOS OS POLIGONOS NA TELA QUANDO O PROGRAMA RECEBE A LETRA 'N' PELO TERMINAL */
     printf("Pressione 'N' para começar o desenho: ");
@@ -174,18 +178,19 @@ int main()
 
     /* Loop da animação */
     while (1){
+        gpu_trace_frame(); /* Marca o quadro no rastreamento, sem efeito quando desligado */
         x += 10;
         x2 -= 10;
 
         set_sprite(1, x, 50, 6, 1); /* Nave superior */
-        set_sprite(10, x - 60, 50, 28, 1); /* SPRITE COM A LETRA P */
-        set_sprite(11, x - 40, 50, 29, 1); /* SPRITE COM A LETRA M */
-        set_sprite(12, x - 20, 50, 30, 1); /* SPRITE COM A LETRA D */
+        set_sprite(10, x - 60, 50, 28, gpu_slot_ready(28)); /* SPRITE COM A LETRA P */
+        set_sprite(11, x - 40, 50, 29, gpu_slot_ready(29)); /* SPRITE COM A LETRA M */
+        set_sprite(12, x - 20, 50, 30, gpu_slot_ready(30)); /* SPRITE COM A LETRA D */
         
         set_sprite(4, x2, 100, 8, 1); /* Nave inferior */
-        set_sprite(25, x2 + 20, 100, 25, 1); /* SPRITE COM A PRIMEIRA PARTE DE 'ANFRANSERAI' */
-        set_sprite(26, x2 + 40, 100, 26, 1); /* SPRITE COM A SEGUNDA PARTE DE 'ANFRANSERAI' */
-        set_sprite(27, x2 + 60, 100, 27, 1); /* SPRITE COM A TERCEIRA PARTE DE 'ANFRANSERAI */
+        set_sprite(25, x2 + 20, 100, 25, gpu_slot_ready(25)); /* SPRITE COM A PRIMEIRA PARTE DE 'ANFRANSERAI' */
+        set_sprite(26, x2 + 40, 100, 26, gpu_slot_ready(26)); /* SPRITE COM A SEGUNDA PARTE DE 'ANFRANSERAI' */
+        set_sprite(27, x2 + 60, 100, 27, gpu_slot_ready(27)); /* SPRITE COM A TERCEIRA PARTE DE 'ANFRANSERAI */
 
     /* Verifica se os sprites chegaram no fim da tela e reseta suas posições*/
     if (x == 620){
@@ -0,0 +1,172 @@
+/**
+ * \file            render_bench.c
+ * \brief           Desenha a cena do main.c no simulador com o renderizador de referencia, mede quadros por segundo e confere a imagem
+ */
+
+/*
+ * Copyright (c) 2024 Pedro Henrique Araujo Almeida, Dermeval Neves de Oliveira Filho, Matheus
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE
+ * AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of library_name.
+ *
+ * Author:          Pedro Henrique ARAUJO ALMEIDA <phaalmeida1\gmail.com>
+ *                  Dermeval Neves de Oliveira Filho <dermevalneves\gmail.com>
+ *                  Matheus Mota Santos<matheuzwork\gmail.com>
+ */
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <time.h>
+#include "gpu_lib.h"
+#include "gpu_render.h"
+
+/* Quantidade padrao de quadros renderizados na medição */
+#define DEFAULT_FRAMES 2000
+
+static uint16_t frame[GPU_SCREEN_WIDTH * GPU_SCREEN_HEIGHT];
+
+/**
+ * \brief           Usada para ler o relogio monotonico em nanossegundos
+ */
+static uint64_t now_ns() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+/**
+ * \brief           Usada para desenhar a cena completa do main.c: casa, lua, chão, estrelas e sprites
+ */
+static void draw_house() {
+    set_background_color(0, 0, 0);
+    draw_sprites_anfranserai();
+    draw_sprites_PMD();
+
+    set_poligono(6, 400, 300, 9, 0, 0, 5, 0);
+    set_poligono(5, 400, 200, 10, 5, 0, 0, 1);
+    set_poligono(2, 380, 310, 1, 4, 2, 0, 0);
+    set_poligono(1, 420, 335, 2, 4, 2, 0, 0);
+    set_poligono(0, 420, 305, 2, 4, 2, 0, 0);
+    set_poligono(14, 500, 100, 4, 7, 7, 7, 0);
+
+    fill_background_blocks(35);
+
+    set_background_block(10, 10, 7, 5, 0);
+    set_background_block(25, 13, 7, 5, 0);
+    set_background_block(34, 11, 7, 5, 0);
+    set_background_block(15, 15, 7, 5, 0);
+    set_background_block(46, 12, 7, 5, 0);
+    set_background_block(40, 10, 7, 5, 0);
+    set_background_block(33, 16, 7, 5, 0);
+    set_background_block(70, 13, 7, 5, 0);
+    set_background_block(8, 15, 7, 5, 0);
+    set_background_block(75, 9, 7, 5, 0);
+    set_background_block(78, 15, 7, 5, 0);
+
+    set_sprite(1, 0, 50, 6, 1);
+    set_sprite(4, 620, 100, 8, 1);
+    set_sprite(2, 200, 330, 4, 1);
+    set_sprite(3, 250, 330, 4, 1);
+}
+
+/**
+ * \brief           Usada para mover as naves e as letras como no laço de animação do main.c
+ */
+static void animate(uint32_t step) {
+    uint16_t x = (step * 10) % 620;
+    uint16_t x2 = 620 - x;
+
+    gpu_begin_batch();
+    set_sprite(1, x, 50, 6, 1);
+    set_sprite(10, x - 60, 50, 28, 1);
+    set_sprite(11, x - 40, 50, 29, 1);
+    set_sprite(12, x - 20, 50, 30, 1);
+    set_sprite(4, x2, 100, 8, 1);
+    set_sprite(25, x2 + 20, 100, 25, 1);
+    set_sprite(26, x2 + 40, 100, 26, 1);
+    set_sprite(27, x2 + 60, 100, 27, 1);
+    gpu_submit_batch();
+}
+
+int main(int argc, char *argv[]) {
+    struct gpu_sim_config config = GPU_SIM_DEFAULTS;
+    struct gpu_render_state state;
+    Gpu_Device *gpu;
+    uint32_t frames = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_FRAMES;
+    uint64_t hash, start, elapsed;
+    uint32_t i;
+
+    if (argc > 4 || frames == 0) {
+        fprintf(stderr, "Uso: %s [quadros] [imagem.ppm] [hash esperado]\n", argv[0]);
+        return 1;
+    }
+
+    /* GPU infinitamente rapida: so o custo da biblioteca e do renderizador é medido */
+    gpu_render_init(&state);
+    config.drain_ns = 0;
+    config.write_ns = 0;
+    config.observer = gpu_render_observer;
+    config.observer_context = &state;
+    gpu = open_gpu_simulator(&config);
+    if (gpu == NULL) {
+        return 1;
+    }
+    gpu_use_device(gpu);
+
+    draw_house();
+    gpu_sync();
+    gpu_render_frame(&state, frame);
+    hash = gpu_render_hash(frame);
+    printf("cena do main.c: hash %016" PRIx64 "\n", hash);
+    if (argc > 2 && !gpu_render_write_ppm(frame, argv[2])) {
+        return 1;
+    }
+
+    /* So renderização, memorias paradas */
+    start = now_ns();
+    for (i = 0; i < frames; i++) {
+        gpu_render_frame(&state, frame);
+    }
+    elapsed = now_ns() - start;
+    printf("renderização: %u quadros, %.1f quadros/s, %.1f us/quadro\n", frames, frames * 1e9 / elapsed, elapsed / 1e3 / frames);
+
+    /* Animação do main.c: comandos pela biblioteca, simulador e renderização a cada quadro */
+    start = now_ns();
+    for (i = 0; i < frames; i++) {
+        animate(i);
+        gpu_render_frame(&state, frame);
+    }
+    elapsed = now_ns() - start;
+    printf("animação: %u quadros, %.1f quadros/s, %.1f us/quadro\n", frames, frames * 1e9 / elapsed, elapsed / 1e3 / frames);
+
+    close_gpu_device_at(gpu);
+
+    if (argc > 3 && strtoull(argv[3], NULL, 16) != hash) {
+        fprintf(stderr, "Imagem diferente da referencia %s\n", argv[3]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,210 @@
+/**
+ * \file            replay.c
+ * \brief           Programa que reenvia para a GPU os comandos de uma gravação feita com gpu_record_start()
+ */
+
+/*
+ * Copyright (c) 2024 Pedro Henrique Araujo Almeida, Dermeval Neves de Oliveira Filho, Matheus
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE
+ * AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of library_name.
+ *
+ * Author:          Pedro Henrique ARAUJO ALMEIDA <phaalmeida1\gmail.com>
+ *                  Dermeval Neves de Oliveira Filho <dermevalneves\gmail.com>
+ *                  Matheus Mota Santos<matheuzwork\gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "gpu_lib.h"
+
+/**
+ * \brief           Usada para ler o relogio monotonico em nanossegundos
+ */
+static uint64_t now_ns() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+/**
+ * \brief           Usada para dormir ate o instante deadline do relogio monotonico
+ */
+static void sleep_until(uint64_t deadline) {
+    struct timespec until;
+
+    until.tv_sec = deadline / 1000000000u;
+    until.tv_nsec = deadline % 1000000000u;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) != 0) {
+    }
+}
+
+/**
+ * \brief           Usada para ler a gravação inteira para a memoria, assim a leitura do arquivo nao entra na medição
+ *
+ * \param[in]       path: Caminho da gravação
+ * \param[out]      size: Tamanho dos registros lidos, sem o cabeçalho
+ * \return          Retorna os registros, ou NULL quando ocorreu uma falha
+ */
+static unsigned char *load_record(const char *path, size_t *size) {
+    struct gpu_record_file header;
+    unsigned char *data;
+    long end;
+    FILE *file;
+
+    file = fopen(path, "rb");
+    if (file == NULL) {
+        perror("Failed to open the record file");
+        return NULL;
+    }
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != GPU_RECORD_MAGIC) {
+        fprintf(stderr, "Gravação inválida\n");
+        fclose(file);
+        return NULL;
+    }
+
+    fseek(file, 0, SEEK_END);
+    end = ftell(file);
+    fseek(file, sizeof(header), SEEK_SET);
+    *size = end - sizeof(header);
+
+    data = malloc(*size ? *size : 1);
+    if (data == NULL || fread(data, 1, *size, file) != *size) {
+        fprintf(stderr, "Falha ao ler a gravação\n");
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    return data;
+}
+
+int main(int argc, char *argv[]) {
+    struct gpu_sim_stats sim_stats;
+    struct gpu_record_entry entry;
+    struct gpu_command command;
+    const char *path = NULL, *target = DEVICE_PATH;
+    unsigned char *data;
+    size_t size, offset;
+    uint64_t start, elapsed, recorded_ns = 0, late_ns = 0;
+    uint32_t commands = 0, frames = 0, failures = 0;
+    int fast = 0, i;
+    Gpu_Device *gpu;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--fast") == 0) {
+            fast = 1;
+        } else if (path == NULL) {
+            path = argv[i];
+        } else {
+            target = argv[i];
+        }
+    }
+    if (path == NULL) {
+        fprintf(stderr, "Uso: %s <gravação> [--fast] [dispositivo|sim]\n", argv[0]);
+        return 1;
+    }
+
+    data = load_record(path, &size);
+    if (data == NULL) {
+        return 1;
+    }
+    gpu = strcmp(target, "sim") == 0 ? open_gpu_simulator(NULL) : open_gpu_device_at(target);
+    if (gpu == NULL) {
+        free(data);
+        return 1;
+    }
+    gpu_use_device(gpu);
+
+    /* Sem o tempo original cada quadro vai em um unico lote */
+    if (fast) {
+        gpu_begin_batch();
+    }
+
+    start = now_ns();
+    for (offset = 0; offset + sizeof(entry) <= size; offset += sizeof(entry) + entry.length) {
+        memcpy(&entry, data + offset, sizeof(entry));
+        if (entry.length > GPU_COMMAND_SIZE || offset + sizeof(entry) + entry.length > size) {
+            fprintf(stderr, "Registro inválido na posição %zu\n", offset);
+            break;
+        }
+
+        recorded_ns += entry.delta_ns;
+        if (!fast) {
+            uint64_t now = now_ns(), deadline = start + recorded_ns;
+
+            if (deadline > now) {
+                sleep_until(deadline);
+            } else if (now - deadline > late_ns) {
+                late_ns = now - deadline;
+            }
+        }
+
+        switch (entry.type) {
+            case GPU_RECORD_COMMAND:
+                memset(&command, 0, sizeof(command));
+                memcpy(command.bytes, data + offset + sizeof(entry), entry.length);
+                failures += !gpu_send_command(&command, entry.length);
+                commands++;
+                break;
+            case GPU_RECORD_FRAME:
+                gpu_trace_frame();
+                if (fast && frames) {
+                    failures += !gpu_submit_batch();
+                    gpu_begin_batch();
+                }
+                frames++;
+                break;
+            case GPU_RECORD_BEGIN:
+                gpu_begin_batch();
+                break;
+            case GPU_RECORD_SUBMIT:
+                failures += !gpu_submit_batch();
+                break;
+        }
+    }
+    if (fast) {
+        failures += !gpu_submit_batch();
+    }
+    gpu_sync();
+    elapsed = now_ns() - start;
+
+    printf("%u comandos e %u quadros em %.3f ms (gravação: %.3f ms)\n", commands, frames, elapsed / 1e6, recorded_ns / 1e6);
+    printf("%.0f comandos/s, %.1f quadros/s\n", commands * 1e9 / elapsed, frames * 1e9 / elapsed);
+    if (!fast) {
+        printf("maior atraso em relação à gravação: %.3f us\n", late_ns / 1000.0);
+    }
+    if (gpu_sim_get_stats(&sim_stats)) {
+        printf("simulador: %llu esperas por WRFULL, %.3f ms esperando, ocupação maxima %u\n",
+               (unsigned long long) sim_stats.stalls, sim_stats.stall_ns / 1e6, sim_stats.max_level);
+    }
+    if (failures) {
+        printf("%u envios falharam\n", failures);
+    }
+
+    close_gpu_device_at(gpu);
+    free(data);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,180 @@
+/**
+ * \file            sprite_atlas.c
+ * \brief           Programa que monta um atlas de bitmaps de sprites (gpu_load_atlas()) a partir de imagens PPM
+ */
+
+/*
+ * Copyright (c) 2024 Pedro Henrique Araujo Almeida, Dermeval Neves de Oliveira Filho, Matheus
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE
+ * AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of library_name.
+ *
+ * Author:          Pedro Henrique ARAUJO ALMEIDA <phaalmeida1\gmail.com>
+ *                  Dermeval Neves de Oliveira Filho <dermevalneves\gmail.com>
+ *                  Matheus Mota Santos<matheuzwork\gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "gpu_lib.h"
+#include "gpu_image.h"
+
+/**
+ * \brief           Usada para converter um trecho de 20x20 pixels de uma imagem PPM (P6) em cores de 9 bits
+ *
+ * A origem é "<imagem.ppm>" ou "<imagem.ppm>@<x>,<y>" para recortar o sprite de uma folha
+ * de sprites.
+ *
+ * \param[in]       source: Imagem e posição do trecho
+ * \param[in]       dither: Pontilhamento, GPU_DITHER_*
+ * \param[in]       key: Cor transparente em 0xRRGGBB, ou GPU_IMAGE_NO_KEY
+ * \param[out]      pixels: Bitmap lido
+ * \return          Retorna 0 quando a operação não foi realizada, e 1 quando foi bem sucedida
+ */
+static int read_sprite(char *source, int dither, int32_t key, uint16_t pixels[GPU_SPRITE_PIXELS]) {
+    struct gpu_image image;
+    unsigned int x = 0, y = 0;
+    char *position;
+    int result;
+
+    position = strrchr(source, '@');
+    if (position != NULL) {
+        if (sscanf(position + 1, "%u,%u", &x, &y) != 2) {
+            fprintf(stderr, "Posição inválida em %s\n", source);
+            return 0;
+        }
+        *position = '\0';
+    }
+    if (!gpu_image_read_ppm(source, &image)) {
+        return 0;
+    }
+    result = gpu_image_sprite(&image, x, y, dither, key, pixels);
+    gpu_image_free(&image);
+    return result;
+}
+
+/**
+ * \brief           Usada para mostrar os slots e hashes de um atlas
+ * \return          Retorna 0 quando o atlas é valido, e 1 caso contrario
+ */
+static int list_atlas(const char *path) {
+    struct gpu_atlas_file header;
+    struct gpu_atlas_slot slot;
+    FILE *file;
+    uint32_t i;
+
+    file = fopen(path, "rb");
+    if (file == NULL) {
+        perror(path);
+        return 1;
+    }
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != GPU_ATLAS_MAGIC) {
+        fprintf(stderr, "Atlas inválido\n");
+        fclose(file);
+        return 1;
+    }
+    for (i = 0; i < header.count && fread(&slot, sizeof(slot), 1, file) == 1; i++) {
+        printf("slot %2u  hash %016llx%s\n", slot.slot, (unsigned long long) slot.hash,
+               gpu_atlas_hash(slot.pixels) == slot.hash ? "" : "  [hash incorreto]");
+    }
+    fclose(file);
+    return i == header.count ? 0 : 1;
+}
+
+int main(int argc, char *argv[]) {
+    struct gpu_atlas_file header = { .magic = GPU_ATLAS_MAGIC };
+    struct gpu_atlas_slot *slots;
+    int dither = GPU_DITHER_NONE;
+    int32_t key = GPU_IMAGE_NO_KEY;
+    uint32_t used = 0;
+    FILE *file;
+    int i;
+
+    if (argc == 3 && strcmp(argv[1], "-l") == 0) {
+        return list_atlas(argv[2]);
+    }
+    /* Opções da conversão antes do atlas */
+    while (argc > 2 && argv[1][0] == '-') {
+        if (strcmp(argv[1], "-d") == 0 && strcmp(argv[2], "none") == 0) {
+            dither = GPU_DITHER_NONE;
+        } else if (strcmp(argv[1], "-d") == 0 && strcmp(argv[2], "ordered") == 0) {
+            dither = GPU_DITHER_ORDERED;
+        } else if (strcmp(argv[1], "-d") == 0 && strcmp(argv[2], "floyd") == 0) {
+            dither = GPU_DITHER_FLOYD;
+        } else if (strcmp(argv[1], "-k") == 0) {
+            key = strtol(argv[2], NULL, 16) & 0xFFFFFF;
+        } else {
+            break;
+        }
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc < 3) {
+        fprintf(stderr,
+                "Uso: %s [-d none|ordered|floyd] [-k RRGGBB] <atlas> <slot>:<imagem.ppm>[@x,y]...\n"
+                "       %s -l <atlas>\n",
+                argv[0], argv[0]);
+        return 1;
+    }
+
+    slots = calloc(argc - 2, sizeof(*slots));
+    if (slots == NULL) {
+        perror("Failed to allocate the atlas");
+        return 1;
+    }
+    for (i = 2; i < argc; i++) {
+        struct gpu_atlas_slot *slot = &slots[header.count];
+        char *image;
+
+        slot->slot = strtoul(argv[i], &image, 10);
+        if (*image != ':' || slot->slot >= GPU_SPRITE_SLOTS || (used & (1u << slot->slot))) {
+            fprintf(stderr, "Slot inválido ou repetido em %s\n", argv[i]);
+            free(slots);
+            return 1;
+        }
+        if (!read_sprite(image + 1, dither, key, slot->pixels)) {
+            free(slots);
+            return 1;
+        }
+        slot->hash = gpu_atlas_hash(slot->pixels);
+        used |= 1u << slot->slot;
+        header.count++;
+    }
+
+    file = fopen(argv[1], "wb");
+    if (file == NULL) {
+        perror(argv[1]);
+        free(slots);
+        return 1;
+    }
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(slots, sizeof(*slots), header.count, file);
+    free(slots);
+    if (fclose(file) != 0) {
+        perror(argv[1]);
+        return 1;
+    }
+    printf("%u bitmaps gravados em %s\n", header.count, argv[1]);
+    return 0;
+}
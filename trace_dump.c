@@ -0,0 +1,165 @@
+/**
+ * \file            trace_dump.c
+ * \brief           Programa que mostra os comandos e o tempo de cada quadro de um rastreamento gravado por gpu_trace_dump()
+ */
+
+/*
+ * Copyright (c) 2024 Pedro Henrique Araujo Almeida, Dermeval Neves de Oliveira Filho, Matheus
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE
+ * AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of library_name.
+ *
+ * Author:          Pedro Henrique ARAUJO ALMEIDA <phaalmeida1\gmail.com>
+ *                  Dermeval Neves de Oliveira Filho <dermevalneves\gmail.com>
+ *                  Matheus Mota Santos<matheuzwork\gmail.com>
+ */
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "gpu_lib.h"
+
+/**
+ * \brief           Usada para mostrar uma instrução ja montada em texto
+ */
+static void print_instruction(struct gpu_instruction instruction) {
+    uint32_t address = instruction.data_a >> 4;
+    uint32_t data = instruction.data_b;
+
+    switch (instruction.data_a & 0b11) {
+        case GPU_OPCODE_WBR:
+            if (address == 0) {
+                printf("WBR background r=%u g=%u b=%u", data & 0b111, (data >> 3) & 0b111, (data >> 6) & 0b111);
+            } else {
+                printf("WBR sprite reg=%u x=%u y=%u offset=%u sp=%u", address, (data >> 19) & 0x3FF, (data >> 9) & 0x3FF,
+                       data & 0x1FF, (data >> 29) & 1);
+            }
+            break;
+        case GPU_OPCODE_WSM:
+            printf("WSM address=%u r=%u g=%u b=%u", address, data & 0b111, (data >> 3) & 0b111, (data >> 6) & 0b111);
+            break;
+        case GPU_OPCODE_WBM:
+            printf("WBM column=%u line=%u r=%u g=%u b=%u", address % 80, address / 80, data & 0b111, (data >> 3) & 0b111,
+                   (data >> 6) & 0b111);
+            break;
+        default:
+            printf("DP address=%u x=%u y=%u size=%u r=%u g=%u b=%u shape=%u", address, data & 0x1FF, (data >> 9) & 0x1FF,
+                   (data >> 18) & 0b1111, (data >> 22) & 0b111, (data >> 25) & 0b111, (data >> 28) & 0b111, data >> 31);
+            break;
+    }
+}
+
+/**
+ * \brief           Usada para mostrar um comando no formato dos lotes em texto
+ */
+static void print_command(const struct gpu_trace_entry *entry) {
+    const uint8_t *bytes = entry->command.bytes;
+    int i;
+
+    switch (bytes[0]) {
+        case GPU_CMD_RAW:
+            print_instruction(gpu_unpack_raw(&entry->command));
+            break;
+        case GPU_CMD_FILL_BLOCKS:
+            printf("FILL_BLOCKS column=%u line=%u width=%u height=%u r=%u g=%u b=%u", bytes[1], bytes[2], bytes[3], bytes[4],
+                   bytes[5], bytes[6], bytes[7]);
+            break;
+        case GPU_CMD_CLEAR_SPRITES:
+            printf("CLEAR_SPRITES first=%u count=%u", bytes[1], bytes[2]);
+            break;
+        case GPU_CMD_CLEAR_POLYGONS:
+            printf("CLEAR_POLYGONS first=%u count=%u", bytes[1], bytes[2]);
+            break;
+        default:
+            /* Comandos avulsos antigos, mostrados como foram enviados */
+            printf("CMD %u", bytes[0]);
+            for (i = 1; i < entry->length && i < GPU_COMMAND_SIZE; i++) {
+                printf(" %02x", bytes[i]);
+            }
+            break;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    struct gpu_trace_file header;
+    struct gpu_trace_entry entry;
+    uint64_t previous_ns = 0, frame_ns = 0, frame_max_ns = 0, frame_total_ns = 0;
+    uint32_t frames = 0, frame_commands = 0, failures = 0, i;
+    FILE *file;
+
+    if (argc != 2) {
+        fprintf(stderr, "Uso: %s <arquivo de rastreamento>\n", argv[0]);
+        return 1;
+    }
+
+    file = fopen(argv[1], "rb");
+    if (file == NULL) {
+        perror("Failed to open the trace file");
+        return 1;
+    }
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != GPU_TRACE_MAGIC) {
+        fprintf(stderr, "Arquivo de rastreamento inválido\n");
+        fclose(file);
+        return 1;
+    }
+
+    printf("%u registros, %llu perdidos\n", header.count, (unsigned long long) header.lost);
+
+    for (i = 0; i < header.count && fread(&entry, sizeof(entry), 1, file) == 1; i++) {
+        /* Tempo desde o registro anterior */
+        double delta_us = previous_ns ? (entry.time_ns - previous_ns) / 1000.0 : 0.0;
+
+        previous_ns = entry.time_ns;
+        if (entry.type == GPU_TRACE_FRAME) {
+            if (frame_ns) {
+                uint64_t duration = entry.time_ns - frame_ns;
+
+                printf("-- quadro %u: %u comandos em %.3f us\n", frames, frame_commands, duration / 1000.0);
+                frame_total_ns += duration;
+                frame_max_ns = duration > frame_max_ns ? duration : frame_max_ns;
+                frames++;
+            }
+            frame_ns = entry.time_ns;
+            frame_commands = 0;
+            continue;
+        }
+
+        printf("%10.3f us  ", delta_us);
+        print_command(&entry);
+        if (!entry.result) {
+            printf("  [falha]");
+            failures++;
+        }
+        printf("\n");
+        frame_commands++;
+    }
+    fclose(file);
+
+    if (frames) {
+        printf("%u quadros, media %.3f us, maximo %.3f us\n", frames, frame_total_ns / 1000.0 / frames, frame_max_ns / 1000.0);
+    }
+    if (failures) {
+        printf("%u comandos falharam\n", failures);
+    }
+    return 0;
+}